@@ -0,0 +1,258 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Ascii.hpp: end-of-line translation for ASCII ("A") type transfers
+*/
+#ifndef ASCII_HPP
+#define ASCII_HPP 1
+
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_HAVE_AVX2 1
+#endif
+
+// LF -> CRLF on the way out (RETR, LIST) and CRLF -> LF on the way in
+// (STOR); every kernel scans a vector at a time for the one byte it cares
+// about and copies the runs in between, with a byte-wise fallback
+class Ascii {
+public:
+  // LF -> CRLF; `out` must hold 2 * `len` bytes; returns bytes written
+  static size_t encode(char const* in, size_t len, char* out) {
+    static EncodeFn const fn = _pick_encode();
+    return fn(in, len, out);
+  }
+
+  // CRLF -> LF; `out` must hold `len` + 1 bytes; returns bytes written.
+  // `pending_cr` carries a CR that ended the previous buffer (start with
+  // false, and call finish() after the last buffer)
+  static size_t decode(char const* in, size_t len, char* out, bool& pending_cr) {
+    static DecodeFn const fn = _pick_decode();
+    return fn(in, len, out, pending_cr);
+  }
+
+  // flush a CR that ended the last buffer; returns bytes written
+  static size_t finish(char* out, bool& pending_cr) {
+    if (!pending_cr) {
+      return 0;
+    }
+
+    pending_cr = false;
+    out[0] = '\r';
+    return 1;
+  }
+
+  static size_t encode_scalar(char const* in, size_t len, char* out) {
+    size_t o = 0;
+
+    for (size_t i = 0; i < len; i++) {
+      if (in[i] == '\n') {
+	out[o++] = '\r';
+      }
+
+      out[o++] = in[i];
+    }
+
+    return o;
+  }
+
+  static size_t decode_scalar(char const* in, size_t len, char* out, bool& pending_cr) {
+    size_t o = _decode_start(in, len, out, pending_cr);
+
+    for (size_t i = 0; i < len; i++) {
+      if (in[i] == '\r') {
+	if (i + 1 == len) {
+	  pending_cr = true;
+	  break;
+	} else if (in[i + 1] == '\n') {
+	  continue;
+	}
+      }
+
+      out[o++] = in[i];
+    }
+
+    return o;
+  }
+
+#ifdef __SSE2__
+  static size_t encode_sse2(char const* in, size_t len, char* out) {
+    __m128i const lf = _mm_set1_epi8('\n');
+    size_t i = 0, o = 0;
+
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i const*)(in + i));
+      unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+      if (mask == 0) {
+	_mm_storeu_si128((__m128i*)(out + o), v);
+	o += 16;
+      } else {
+	o = _encode_block(in + i, 16, mask, out, o);
+      }
+    }
+
+    return o + encode_scalar(in + i, len - i, out + o);
+  }
+
+  static size_t decode_sse2(char const* in, size_t len, char* out, bool& pending_cr) {
+    __m128i const cr = _mm_set1_epi8('\r');
+    size_t o = _decode_start(in, len, out, pending_cr);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i const*)(in + i));
+      unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+
+      if (mask == 0) {
+	_mm_storeu_si128((__m128i*)(out + o), v);
+	o += 16;
+      } else {
+	o = _decode_block(in, len, i, 16, mask, out, o, pending_cr);
+      }
+    }
+
+    return o + decode_scalar(in + i, len - i, out + o, pending_cr);
+  }
+#endif
+
+#ifdef ASCII_HAVE_AVX2
+  __attribute__((target("avx2")))
+  static size_t encode_avx2(char const* in, size_t len, char* out) {
+    __m256i const lf = _mm256_set1_epi8('\n');
+    size_t i = 0, o = 0;
+
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i const*)(in + i));
+      unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+      if (mask == 0) {
+	_mm256_storeu_si256((__m256i*)(out + o), v);
+	o += 32;
+      } else {
+	o = _encode_block(in + i, 32, mask, out, o);
+      }
+    }
+
+    return o + encode_scalar(in + i, len - i, out + o);
+  }
+
+  __attribute__((target("avx2")))
+  static size_t decode_avx2(char const* in, size_t len, char* out, bool& pending_cr) {
+    __m256i const cr = _mm256_set1_epi8('\r');
+    size_t o = _decode_start(in, len, out, pending_cr);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i const*)(in + i));
+      unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+
+      if (mask == 0) {
+	_mm256_storeu_si256((__m256i*)(out + o), v);
+	o += 32;
+      } else {
+	o = _decode_block(in, len, i, 32, mask, out, o, pending_cr);
+      }
+    }
+
+    return o + decode_scalar(in + i, len - i, out + o, pending_cr);
+  }
+#endif
+
+private:
+  typedef size_t (*EncodeFn)(char const*, size_t, char*);
+  typedef size_t (*DecodeFn)(char const*, size_t, char*, bool&);
+
+  static EncodeFn _pick_encode() {
+#ifdef ASCII_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+      return encode_avx2;
+    }
+#endif
+#ifdef __SSE2__
+    return encode_sse2;
+#else
+    return encode_scalar;
+#endif
+  }
+
+  static DecodeFn _pick_decode() {
+#ifdef ASCII_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+      return decode_avx2;
+    }
+#endif
+#ifdef __SSE2__
+    return decode_sse2;
+#else
+    return decode_scalar;
+#endif
+  }
+
+  // copy a block with LFs at the bits set in `mask`, adding a CR before each
+  static size_t _encode_block(char const* in, size_t n, unsigned mask, char* out, size_t o) {
+    size_t start = 0;
+
+    while (mask != 0) {
+      size_t lf = __builtin_ctz(mask);
+      memcpy(out + o, in + start, lf - start);
+      o += lf - start;
+      out[o++] = '\r';
+      out[o++] = '\n';
+      start = lf + 1;
+      mask &= mask - 1;
+    }
+
+    memcpy(out + o, in + start, n - start);
+    return o + (n - start);
+  }
+
+  // copy the block at `in + i` with CRs at the bits set in `mask`, dropping
+  // each CR that is followed by an LF (which may sit in the next block)
+  static size_t _decode_block(char const* in, size_t len, size_t i, size_t n,
+			      unsigned mask, char* out, size_t o, bool& pending_cr) {
+    size_t start = 0;
+
+    while (mask != 0) {
+      size_t cr = __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      if (i + cr + 1 == len) {
+	// last byte of the buffer: decide once the next one arrives
+	memcpy(out + o, in + i + start, cr - start);
+	o += cr - start;
+	pending_cr = true;
+	return o;
+      }
+
+      if (in[i + cr + 1] == '\n') {
+	memcpy(out + o, in + i + start, cr - start);
+	o += cr - start;
+	start = cr + 1;
+      }
+    }
+
+    memcpy(out + o, in + i + start, n - start);
+    return o + (n - start);
+  }
+
+  // deal with a CR held back from the previous buffer
+  static size_t _decode_start(char const* in, size_t len, char* out, bool& pending_cr) {
+    if (!pending_cr || len == 0) {
+      return 0;
+    }
+
+    pending_cr = false;
+
+    if (in[0] == '\n') {
+      return 0;
+    }
+
+    out[0] = '\r';
+    return 1;
+  }
+};
+
+#endif
@@ -0,0 +1,202 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Channel.hpp: class for a control or data connection, optionally over TLS
+*/
+#ifndef CHANNEL_HPP
+#define CHANNEL_HPP 1
+
+#include <cstdint>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <openssl/ssl.h>
+#include "Tls.hpp"
+#include "TransferTuner.hpp"
+
+// a connected socket; once start_tls() succeeds everything goes through
+// OpenSSL, which transparently uses kernel TLS when it managed to set it up;
+// with a tuner attached, I/O is cut into the chunks it asks for
+class Channel {
+public:
+  explicit Channel(int fd_=-1) : fd(fd_), ssl(nullptr), tuner(nullptr) {
+  }
+
+  // let `tuner_` pick chunk sizes and see progress (it must outlive us)
+  void set_tuner(TransferTuner* tuner_) {
+    this->tuner = tuner_;
+  }
+
+  // switch to another socket (dropping any TLS state)
+  void reset(int fd_) {
+    this->end_tls();
+    this->fd = fd_;
+  }
+
+  // do the server side of a TLS handshake on our socket
+  bool start_tls(TlsContext const& tls) {
+    this->ssl = SSL_new(tls.get());
+
+    if (this->ssl == nullptr || SSL_set_fd(this->ssl, this->fd) != 1 ||
+	SSL_accept(this->ssl) != 1) {
+      ERR_clear_error();
+      this->end_tls();
+      return false;
+    }
+
+    return true;
+  }
+
+  // send close_notify and go back to plain socket I/O
+  void end_tls() {
+    if (this->ssl != nullptr) {
+      if (SSL_is_init_finished(this->ssl)) {
+	SSL_shutdown(this->ssl);
+      }
+
+      SSL_free(this->ssl);
+      this->ssl = nullptr;
+    }
+  }
+
+  bool secure() const {
+    return this->ssl != nullptr;
+  }
+
+  // can we sendfile() straight into the socket?
+  bool zero_copy() const {
+    return this->ssl == nullptr || BIO_get_ktls_send(SSL_get_wbio(this->ssl));
+  }
+
+  int get_fd() const {
+    return this->fd;
+  }
+
+  // like recv(); 0 means the peer closed the connection
+  ssize_t recv(char* buf, size_t len) const {
+    len = this->_chunk(len);
+
+    for (;;)
+    {
+      if (this->ssl == nullptr) {
+	ssize_t cnt = ::recv(this->fd, buf, len, 0);
+
+	if (cnt == -1 && errno == EINTR) {
+	  continue;
+	}
+
+	this->_progress();
+	return cnt;
+      }
+
+      int cnt = SSL_read(this->ssl, buf, len);
+
+      if (cnt > 0) {
+	this->_progress();
+	return cnt;
+      }
+
+      int err = SSL_get_error(this->ssl, cnt);
+      ERR_clear_error();
+      return (err == SSL_ERROR_ZERO_RETURN ? 0 : -1);
+    }
+  }
+
+  // write a whole buffer
+  bool send_all(char const* buf, size_t len) const {
+    while (len > 0) {
+      size_t want = this->_chunk(len);
+      ssize_t cnt;
+
+      if (this->ssl == nullptr) {
+	cnt = ::send(this->fd, buf, want, MSG_NOSIGNAL);
+
+	if (cnt == -1 && errno == EINTR) {
+	  continue;
+	}
+      } else {
+	cnt = SSL_write(this->ssl, buf, want);
+
+	if (cnt <= 0) {
+	  ERR_clear_error();
+	  cnt = -1;
+	}
+      }
+
+      if (cnt == -1) {
+	return false;
+      }
+
+      buf += cnt;
+      len -= cnt;
+      this->_progress();
+    }
+
+    return true;
+  }
+
+  // send `size` bytes of a file without copying it through userspace
+  // (only call this if zero_copy()); returns bytes sent
+  uint64_t sendfile(int file, uint64_t size) const {
+    off_t off = 0;
+
+    while ((uint64_t)off < size) {
+      size_t want = this->_chunk(size - off);
+      ssize_t cnt;
+
+      if (this->ssl == nullptr) {
+	cnt = ::sendfile(this->fd, file, &off, want);
+      } else {
+	cnt = SSL_sendfile(this->ssl, file, off, want, 0);
+
+	if (cnt > 0) {
+	  off += cnt;
+	} else {
+	  ERR_clear_error();
+	}
+      }
+
+      if (cnt == -1 && errno == EINTR) {
+	continue;
+      } else if (cnt <= 0) {
+	break;
+      }
+
+      this->_progress();
+    }
+
+    return off;
+  }
+
+  // cleanup (the socket itself belongs to whoever created it)
+  virtual ~Channel() {
+    this->end_tls();
+  }
+
+private:
+  Channel(Channel const&) = delete;
+  Channel& operator=(Channel const&) = delete;
+
+  size_t _chunk(size_t len) const {
+    if (this->tuner == nullptr || !this->tuner->active()) {
+      return len;
+    }
+
+    return std::min(len, this->tuner->chunk_size());
+  }
+
+  void _progress() const {
+    if (this->tuner != nullptr) {
+      this->tuner->progress();
+    }
+  }
+
+  int fd;
+  SSL* ssl;
+  TransferTuner* tuner;
+};
+
+#endif
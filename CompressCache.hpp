@@ -0,0 +1,172 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+CompressCache.hpp: class for keeping compressed copies of downloaded files
+*/
+#ifndef COMPRESSCACHE_HPP
+#define COMPRESSCACHE_HPP 1
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+// MODE Z copies of files, each a complete zlib stream ready to be sent as
+// is; an entry is named after the version of the file it came from (device,
+// inode, mtime, size) and how it was compressed (level, type), so a changed
+// file simply misses; the dir is shared by all workers, entries appear by
+// rename() once whole, and the least recently sent go once the dir is over
+// its budget; temp files nobody has written to for `stale_after` (a worker
+// died filling them) go too
+class CompressCache {
+public:
+  // smaller files compress faster than the cache could be checked
+  static const uint64_t min_size = 64 * 1024;
+  static const time_t stale_after = 60 * 60;
+
+  CompressCache() : budget(0) {
+  }
+
+  // use (and create, if need be) `dir_`, holding at most `budget_` bytes
+  bool open(std::string const& dir_, uint64_t budget_) {
+    mkdir(dir_.c_str(), 0755);
+
+    char real[PATH_MAX + 1] { };
+
+    if (realpath(dir_.c_str(), real) == nullptr || access(real, W_OK) == -1) {
+      return false;
+    }
+
+    this->dir = real;
+    this->budget = budget_;
+
+    // clear out whatever the last run left half-written
+    this->_trim();
+    return true;
+  }
+
+  bool valid() const {
+    return !this->dir.empty();
+  }
+
+  // the entry for this version of a file
+  std::string key(struct stat const& st, int level, bool ascii) const {
+    std::stringstream ss;
+    ss << this->dir << '/' << st.st_dev << '-' << st.st_ino << '-' << st.st_mtim.tv_sec
+       << '.' << st.st_mtim.tv_nsec << '-' << st.st_size << '-' << level
+       << (ascii ? 'a' : 'i');
+    return ss.str();
+  }
+
+  // open an entry (and mark it recently used); -1 if there is none
+  int lookup(std::string const& key, uint64_t& size) const {
+    int fd = ::open(key.c_str(), O_RDONLY);
+    struct stat st;
+
+    if (fd != -1 && fstat(fd, &st) == -1) {
+      close(fd);
+      return -1;
+    }
+
+    if (fd != -1) {
+      size = st.st_size;
+      futimens(fd, nullptr);
+    }
+
+    return fd;
+  }
+
+  // a temp file to write a new entry into; sets `tmp` to its path
+  int create(std::string& tmp) const {
+    std::string name = this->dir + "/.tmp.XXXXXX";
+    std::vector<char> buf(name.begin(), name.end());
+    buf.push_back('\0');
+
+    int fd = mkstemp(buf.data());
+    tmp = buf.data();
+    return fd;
+  }
+
+  // publish a finished entry, then trim the cache back to its budget
+  void commit(std::string const& tmp, std::string const& key) const {
+    if (rename(tmp.c_str(), key.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return;
+    }
+
+    this->_trim();
+  }
+
+  // throw away an entry that didn't get finished
+  void abort(std::string const& tmp) const {
+    unlink(tmp.c_str());
+  }
+
+private:
+  CompressCache(CompressCache const&) = delete;
+  CompressCache& operator=(CompressCache const&) = delete;
+
+  // delete stale temp files, then drop the least recently used entries
+  // until we're within budget (temp files still being written count
+  // against it, but are left alone)
+  void _trim() const {
+    DIR* d = opendir(this->dir.c_str());
+
+    if (d == nullptr) {
+      return;
+    }
+
+    std::vector<std::pair<time_t, std::pair<std::string, uint64_t> > > entries;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    dirent* e;
+
+    while ((e = readdir(d)) != nullptr) {
+      std::string name = e->d_name;
+
+      if (name == "." || name == "..") {
+	continue;
+      }
+
+      std::string path = this->dir + '/' + name;
+      struct stat st;
+
+      if (stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+	continue;
+      }
+
+      if (name.compare(0, 5, ".tmp.") != 0) {
+	entries.push_back(std::make_pair(st.st_mtime, std::make_pair(path, st.st_size)));
+	total += st.st_size;
+      } else if (now - st.st_mtime >= stale_after) {
+	unlink(path.c_str());
+      } else {
+	total += st.st_size;
+      }
+    }
+
+    closedir(d);
+    std::sort(entries.begin(), entries.end());
+
+    for (size_t i = 0; i < entries.size() && total > this->budget; i++) {
+      if (unlink(entries[i].second.first.c_str()) == 0) {
+	total -= entries[i].second.second;
+      }
+    }
+  }
+
+  std::string dir;
+  uint64_t budget;
+};
+
+#endif
@@ -0,0 +1,38 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Config.hpp: server settings from the command line
+*/
+#ifndef CONFIG_HPP
+#define CONFIG_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// settings shared by the server and its sessions
+struct Config {
+  // preforked worker processes (0: serve from the main process)
+  unsigned workers;
+  // how far ahead RETR reads files that aren't in the page cache
+  size_t readahead_window;
+  // PEM certificate and key for AUTH TLS (empty: no FTPS)
+  std::string tls_cert;
+  std::string tls_key;
+  // file to record every session's commands to (empty: no tracing)
+  std::string trace_path;
+  // chunk store that uploads are deduplicated into (empty: plain files)
+  std::string dedup_store;
+  // MODE Z compression threads per process (0: one per CPU, up to 4)
+  unsigned compress_threads;
+  // where compressed copies of downloads are kept (empty: no cache), and
+  // how big that may get
+  std::string zcache_dir;
+  uint64_t zcache_budget;
+
+  Config() : workers(0), readahead_window(4 * 1024 * 1024), compress_threads(0),
+    zcache_budget(1024ULL * 1024 * 1024) {
+  }
+};
+
+#endif
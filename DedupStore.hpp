@@ -0,0 +1,807 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+DedupStore.hpp: class for storing uploads as deduplicated chunks
+*/
+#ifndef DEDUPSTORE_HPP
+#define DEDUPSTORE_HPP 1
+
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <unordered_set>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <linux/limits.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include "Ascii.hpp"
+#include "Channel.hpp"
+
+// content-addressed chunk store: uploads are cut into chunks where a
+// rolling (gear) hash of the content hits a magic value, so an edit only
+// changes the chunks around it; every chunk is stored once, under its
+// SHA-256, as "<store>/<2 hex>/<62 hex>", and the uploaded file itself
+// becomes a small manifest listing its chunks, padded out with a hole to
+// the size of the file so that LIST (and anyone else calling stat()) sees
+// the right one; uploads too small to cut are kept as they are; manifests
+// are signed with the store's own key (anyone can upload a file that looks
+// like one), and a copy of each is kept as "<store>/manifests/<id>" until
+// an upload replaces it: collect() keeps the chunks those copies list, so
+// manifests may be moved or linked anywhere (a copy made outside FTP,
+// though, only lasts as long as the manifest it was copied from)
+class DedupStore {
+public:
+  static const size_t min_chunk = 16 * 1024;
+  static const size_t max_chunk = 256 * 1024;
+
+  // a file's list of chunks
+  struct Manifest {
+    struct Entry {
+      std::string hash;
+      uint32_t len;
+    };
+
+    std::string id;
+    uint64_t size;
+    std::vector<Entry> chunks;
+
+    Manifest() : size(0) {
+    }
+  };
+
+  // keeps collect() from running for as long as it lives; held by uploads,
+  // and by downloads of a manifest's chunks
+  class Hold {
+  public:
+    explicit Hold(DedupStore const& store) :
+      fd(::open(store._lock_path().c_str(), O_RDONLY | O_CLOEXEC)) {
+      if (this->fd != -1 && flock(this->fd, LOCK_SH) == -1) {
+	close(this->fd);
+	this->fd = -1;
+      }
+    }
+
+    bool valid() const {
+      return this->fd != -1;
+    }
+
+    // cleanup
+    virtual ~Hold() {
+      if (this->fd != -1) {
+	close(this->fd);
+      }
+    }
+
+  private:
+    Hold(Hold const&) = delete;
+    Hold& operator=(Hold const&) = delete;
+
+    int fd;
+  };
+
+  // cuts one upload into chunks as it streams in
+  class Writer {
+  public:
+    explicit Writer(DedupStore const& store_) : store(store_), hold(store_), hash(0),
+      stored(0), duplicate(0) {
+      this->chunk.reserve(max_chunk);
+    }
+
+    // feed the next bytes of the file
+    bool write(char const* buf, size_t len) {
+      while (len > 0) {
+	bool cut;
+	size_t n = this->_scan(buf, len, cut);
+	this->chunk.insert(this->chunk.end(), buf, buf + n);
+	buf += n;
+	len -= n;
+
+	if (cut && !this->_flush()) {
+	  return false;
+	}
+      }
+
+      return true;
+    }
+
+    // store the last chunk, register the manifest and atomically replace
+    // `target` with it (or with the upload itself, if it was too small to
+    // cut: its manifest would be about as big)
+    bool commit(std::string const& target) {
+      if (!this->hold.valid()) {
+	return false;
+      }
+
+      bool plain = (this->manifest.chunks.empty() && this->chunk.size() < min_chunk);
+      std::string id, text;
+
+      if (plain) {
+	text.assign(this->chunk.begin(), this->chunk.end());
+      } else if (!this->_sign(id, text)) {
+	return false;
+      }
+
+      // the manifest we replace stops holding on to its chunks, unless
+      // it's also linked somewhere else
+      std::string replaced;
+      int old = ::open(target.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (old != -1) {
+	Manifest m;
+	struct stat st;
+
+	if (this->store.load(old, m) && fstat(old, &st) == 0 && st.st_nlink == 1) {
+	  replaced = this->store._registry() + '/' + m.id;
+	}
+
+	close(old);
+      }
+
+      // registered first, so collect() never sees a manifest it doesn't know
+      uint64_t size = (plain ? 0 : this->manifest.size);
+      std::string entry;
+
+      if (!plain) {
+	entry = this->store._registry() + '/' + id;
+	std::string tmp = this->store.dir + "/.manifest.XXXXXX";
+
+	if (!_write_file(tmp, text.data(), text.size(), size)) {
+	  return false;
+	}
+
+	if (rename(tmp.c_str(), entry.c_str()) != 0) {
+	  unlink(tmp.c_str());
+	  return false;
+	}
+      }
+
+      size_t slash = target.rfind('/');
+      std::string tmp = target.substr(0, slash + 1) + '.' + target.substr(slash + 1) +
+	".dedup.XXXXXX";
+
+      if (!_write_file(tmp, text.data(), text.size(), size)) {
+	if (!plain) {
+	  unlink(entry.c_str());
+	}
+
+	return false;
+      }
+
+      if (rename(tmp.c_str(), target.c_str()) != 0) {
+	unlink(tmp.c_str());
+
+	if (!plain) {
+	  unlink(entry.c_str());
+	}
+
+	return false;
+      }
+
+      if (!replaced.empty()) {
+	unlink(replaced.c_str());
+      }
+
+      return true;
+    }
+
+    // bytes that went to new chunks, and bytes that were already stored
+    uint64_t bytes_stored() const {
+      return this->stored;
+    }
+
+    uint64_t bytes_duplicate() const {
+      return this->duplicate;
+    }
+
+  private:
+    Writer(Writer const&) = delete;
+    Writer& operator=(Writer const&) = delete;
+
+    // how much of `buf` belongs to the current chunk; sets `cut` if that
+    // ends it; a byte stays in the gear hash for 64 shifts, so hashing
+    // only has to start 64 bytes before the minimum chunk size
+    size_t _scan(char const* buf, size_t len, bool& cut) {
+      static uint64_t const* const gear = _gear();
+      size_t have = this->chunk.size();
+      size_t i = 0;
+
+      if (have + 64 < min_chunk) {
+	i = std::min(len, min_chunk - 64 - have);
+      }
+
+      for (; i < len; i++) {
+	this->hash = (this->hash << 1) + gear[(unsigned char)buf[i]];
+	size_t size = have + i + 1;
+
+	// the high bits depend on the most bytes: about 1 in 2^16 positions
+	// past the minimum is a boundary
+	if (size >= max_chunk || (size >= min_chunk && (this->hash & cut_mask) == 0)) {
+	  cut = true;
+	  return i + 1;
+	}
+      }
+
+      cut = false;
+      return len;
+    }
+
+    // store the last chunk and write out the signed manifest of the
+    // upload, under a new `id`
+    bool _sign(std::string& id, std::string& text) {
+      if (!this->chunk.empty() && !this->_flush()) {
+	return false;
+      }
+
+      id = _random_hex(16);
+
+      if (id.empty()) {
+	return false;
+      }
+
+      std::stringstream ss;
+      ss << _magic() << id << ' ' << this->manifest.size << '\n';
+
+      for (auto const& e : this->manifest.chunks) {
+	ss << e.hash << ' ' << e.len << '\n';
+      }
+
+      text = ss.str();
+      std::string mac = this->store._mac(text.data(), text.size());
+
+      if (mac.empty()) {
+	return false;
+      }
+
+      text += "mac " + mac + '\n';
+      return true;
+    }
+
+    // hash the current chunk, store it unless it already is, and start
+    // the next one
+    bool _flush() {
+      unsigned char md[EVP_MAX_MD_SIZE];
+      unsigned int md_len = 0;
+
+      if (EVP_Digest(this->chunk.data(), this->chunk.size(), md, &md_len,
+		     EVP_sha256(), nullptr) != 1) {
+	return false;
+      }
+
+      Manifest::Entry e;
+      e.hash = _hex(md, md_len);
+      e.len = this->chunk.size();
+      std::string path = this->store.path_for(e.hash);
+      struct stat st;
+
+      // a chunk of the wrong size can only be left over from a crash
+      if (stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == e.len) {
+	this->duplicate += e.len;
+      } else {
+	mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+	std::string tmp = this->store.dir + "/.chunk.XXXXXX";
+
+	if (!_write_file(tmp, this->chunk.data(), this->chunk.size())) {
+	  return false;
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) != 0) {
+	  unlink(tmp.c_str());
+	  return false;
+	}
+
+	this->stored += e.len;
+      }
+
+      this->manifest.chunks.push_back(e);
+      this->manifest.size += e.len;
+      this->chunk.clear();
+      this->hash = 0;
+      return true;
+    }
+
+    // write `data` to a new file made from the mkstemp() template `tmp`,
+    // followed by a hole up to `size` if that's more, and make sure it's on
+    // disk before anyone renames it into place
+    static bool _write_file(std::string& tmp, char const* data, size_t len,
+			    uint64_t size=0) {
+      std::vector<char> name(tmp.begin(), tmp.end());
+      name.push_back('\0');
+      int fd = mkstemp(name.data());
+
+      if (fd == -1) {
+	return false;
+      }
+
+      tmp = name.data();
+      bool ok = fchmod(fd, 0644) == 0;
+
+      for (size_t done = 0; ok && done < len; ) {
+	ssize_t cnt = ::write(fd, data + done, len - done);
+
+	if (cnt == -1 && errno == EINTR) {
+	  continue;
+	}
+
+	ok = (cnt > 0);
+	done += (ok ? cnt : 0);
+      }
+
+      ok = ok && (size <= len || ftruncate(fd, size) == 0);
+      ok = ok && fsync(fd) == 0;
+      ok = (close(fd) == 0) && ok;
+
+      if (!ok) {
+	unlink(tmp.c_str());
+      }
+
+      return ok;
+    }
+
+    DedupStore const& store;
+    Hold hold;
+    std::vector<char> chunk;
+    uint64_t hash;
+    Manifest manifest;
+    uint64_t stored;
+    uint64_t duplicate;
+  };
+
+  // reads a manifest's chunks back in order, like read() on the file
+  class Reader {
+  public:
+    Reader(DedupStore const& store_, Manifest const& manifest_) : store(store_),
+      manifest(manifest_), index(0), offset(0), fd(-1) {
+    }
+
+    // bytes read, 0 at the end, -1 if a chunk is missing or unreadable
+    ssize_t read(char* buf, size_t len) {
+      while (this->index < this->manifest.chunks.size()) {
+	Manifest::Entry const& e = this->manifest.chunks[this->index];
+
+	if (this->offset == e.len) {
+	  close(this->fd);
+	  this->fd = -1;
+	  this->index++;
+	  this->offset = 0;
+	  continue;
+	}
+
+	if (this->fd == -1 && (this->fd = this->store._open_chunk(e)) == -1) {
+	  return -1;
+	}
+
+	ssize_t cnt = pread(this->fd, buf, std::min<size_t>(len, e.len - this->offset),
+			    this->offset);
+
+	if (cnt <= 0) {
+	  return -1;
+	}
+
+	this->offset += cnt;
+	return cnt;
+      }
+
+      return 0;
+    }
+
+    // cleanup
+    virtual ~Reader() {
+      if (this->fd != -1) {
+	close(this->fd);
+      }
+    }
+
+  private:
+    Reader(Reader const&) = delete;
+    Reader& operator=(Reader const&) = delete;
+
+    DedupStore const& store;
+    Manifest const& manifest;
+    size_t index;
+    uint32_t offset;
+    int fd;
+  };
+
+  DedupStore() {
+  }
+
+  // use (and create, if need be) the store at `dir_`, and its key
+  bool open(std::string const& dir_) {
+    mkdir(dir_.c_str(), 0755);
+
+    char real[PATH_MAX + 1] { };
+
+    if (realpath(dir_.c_str(), real) == nullptr) {
+      return false;
+    }
+
+    struct stat st;
+
+    if (stat(real, &st) == -1 || !S_ISDIR(st.st_mode) || access(real, W_OK) == -1) {
+      return false;
+    }
+
+    this->dir = real;
+    mkdir(this->_registry().c_str(), 0755);
+    close(::open(this->_lock_path().c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644));
+
+    if (!this->_load_key()) {
+      this->dir.clear();
+      return false;
+    }
+
+    return true;
+  }
+
+  bool valid() const {
+    return !this->dir.empty();
+  }
+
+  std::string path_for(std::string const& hash) const {
+    return this->dir + '/' + hash.substr(0, 2) + '/' + hash.substr(2);
+  }
+
+  // parse `fd` as a manifest this store wrote; false for anything else,
+  // which is then just a plain file
+  bool load(int fd, Manifest& m) const {
+    std::string const magic = _magic();
+    std::vector<char> head(magic.size());
+
+    if (pread(fd, head.data(), head.size(), 0) != (ssize_t)head.size() ||
+	std::string(head.begin(), head.end()) != magic) {
+      return false;
+    }
+
+    std::string text;
+    char buf[4096];
+    ssize_t len;
+    off_t pos = 0;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+      return false;
+    }
+
+    // the manifest ends where the hole after it starts
+    while ((len = pread(fd, buf, sizeof(buf), pos)) > 0) {
+      char const* end = (char const*)memchr(buf, '\0', len);
+      text.append(buf, end != nullptr ? end - buf : len);
+      pos += len;
+
+      if (end != nullptr) {
+	break;
+      }
+    }
+
+    // the last line is "mac <hex>", over everything before it
+    size_t mac_at = text.rfind("\nmac ") + 1;
+
+    if (mac_at == 0 || text.size() != mac_at + 4 + 64 + 1 || text.back() != '\n') {
+      return false;
+    }
+
+    std::string mac = this->_mac(text.data(), mac_at);
+
+    if (mac.size() != 64 || CRYPTO_memcmp(mac.data(), text.data() + mac_at + 4, 64) != 0) {
+      return false;
+    }
+
+    std::stringstream ss(text.substr(magic.size(), mac_at - magic.size()));
+    uint64_t total = 0;
+    Manifest::Entry e;
+
+    if (!(ss >> m.id >> m.size)) {
+      return false;
+    }
+
+    while (ss >> e.hash >> e.len) {
+      if (!_valid_hash(e.hash) || e.len == 0 || e.len > max_chunk) {
+	return false;
+      }
+
+      total += e.len;
+      m.chunks.push_back(e);
+    }
+
+    // (and the file has to be as big as the one it stands for)
+    return ss.eof() && total == m.size && (uint64_t)st.st_size == m.size;
+  }
+
+  // delete the chunks no registered manifest lists any more (those of
+  // replaced uploads, and of uploads that never finished); skipped while an
+  // upload is in progress, or if it last ran less than `gc_interval` ago
+  // (unless `force`)
+  void collect(bool force) const {
+    std::string stamp = this->dir + "/.collected";
+    struct stat st;
+
+    if (!force && stat(stamp.c_str(), &st) == 0 && time(NULL) - st.st_mtime < gc_interval) {
+      return;
+    }
+
+    int lock = ::open(this->_lock_path().c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (lock == -1 || flock(lock, LOCK_EX | LOCK_NB) == -1) {
+      if (lock != -1) {
+	close(lock);
+      }
+
+      return;
+    }
+
+    int sfd = ::open(stamp.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (sfd != -1) {
+      futimens(sfd, nullptr);
+      close(sfd);
+    }
+
+    // mark: every chunk of every registered manifest
+    std::unordered_set<std::string> live;
+    std::string registry = this->_registry();
+
+    for (auto const& id : _list(registry)) {
+      std::string entry = registry + '/' + id;
+      int fd = ::open(entry.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      Manifest m;
+      bool ok = (fd != -1 && this->load(fd, m) && m.id == id);
+
+      if (fd != -1) {
+	close(fd);
+      }
+
+      if (!ok) {
+	unlink(entry.c_str());
+	continue;
+      }
+
+      for (auto const& e : m.chunks) {
+	live.insert(e.hash);
+      }
+    }
+
+    // sweep: the rest, and whatever a crashed upload left half-written
+    for (auto const& name : _list(this->dir)) {
+      std::string path = this->dir + '/' + name;
+
+      if (name.compare(0, 7, ".chunk.") == 0 || name.compare(0, 10, ".manifest.") == 0) {
+	unlink(path.c_str());
+      } else if (name.size() == 2 && _valid_hex(name)) {
+	for (auto const& rest : _list(path)) {
+	  if (!live.count(name + rest)) {
+	    unlink((path + '/' + rest).c_str());
+	  }
+	}
+      }
+    }
+
+    close(lock);
+  }
+
+  // stream a manifest's chunks to `out` (LF -> CRLF if `ascii`); returns
+  // the number of file bytes sent, short of the size if something failed
+  uint64_t send(Manifest const& manifest, Channel const& out, bool ascii) const {
+    bool zero_copy = (!ascii && out.zero_copy());
+    std::vector<char> buf(zero_copy ? 0 : max_chunk);
+    std::vector<char> encoded(ascii ? 2 * max_chunk : 0);
+    uint64_t sent = 0;
+    int next = -1;
+
+    for (size_t i = 0; i < manifest.chunks.size(); i++) {
+      Manifest::Entry const& e = manifest.chunks[i];
+      int fd = (i == 0 ? this->_open_chunk(e) : next);
+
+      // have the next chunk on its way from disk while this one goes out
+      next = (i + 1 < manifest.chunks.size() ? this->_open_chunk(manifest.chunks[i + 1]) : -1);
+
+      if (fd == -1) {
+	break;
+      }
+
+      bool ok;
+
+      if (zero_copy) {
+	ok = out.sendfile(fd, e.len) == e.len;
+      } else if ((ok = pread(fd, buf.data(), e.len, 0) == (ssize_t)e.len)) {
+	if (ascii) {
+	  size_t len = Ascii::encode(buf.data(), e.len, encoded.data());
+	  ok = out.send_all(encoded.data(), len);
+	} else {
+	  ok = out.send_all(buf.data(), e.len);
+	}
+      }
+
+      close(fd);
+
+      if (!ok) {
+	break;
+      }
+
+      sent += e.len;
+    }
+
+    if (next != -1) {
+      close(next);
+    }
+
+    return sent;
+  }
+
+private:
+  DedupStore(DedupStore const&) = delete;
+  DedupStore& operator=(DedupStore const&) = delete;
+
+  // top 16 bits of the gear hash: 64KiB past the minimum on average
+  static const uint64_t cut_mask = 0xffffULL << 48;
+  static const time_t gc_interval = 10 * 60;
+  static const size_t key_len = 32;
+
+  // 256 fixed pseudo-random values (splitmix64), the same in every process
+  // and build so that chunk boundaries are too
+  static uint64_t const* _gear() {
+    static uint64_t table[256];
+    uint64_t x = 0x6a09e667f3bcc908ULL;
+
+    for (auto& g : table) {
+      uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      g = z ^ (z >> 31);
+    }
+
+    return table;
+  }
+
+  // the first line of every manifest
+  static char const* _magic() {
+    return "my_ftpd dedup manifest v3\n";
+  }
+
+  static bool _valid_hex(std::string const& s) {
+    return s.find_first_not_of("0123456789abcdef") == std::string::npos;
+  }
+
+  static bool _valid_hash(std::string const& hash) {
+    return hash.size() == 64 && _valid_hex(hash);
+  }
+
+  static std::string _hex(unsigned char const* md, size_t len) {
+    static char const hex[] = "0123456789abcdef";
+    std::string out;
+
+    for (size_t i = 0; i < len; i++) {
+      out.push_back(hex[md[i] >> 4]);
+      out.push_back(hex[md[i] & 15]);
+    }
+
+    return out;
+  }
+
+  // `len` random bytes in hex; empty if there's no randomness to be had
+  static std::string _random_hex(size_t len) {
+    std::vector<unsigned char> buf(len);
+
+    if (RAND_bytes(buf.data(), len) != 1) {
+      return std::string();
+    }
+
+    return _hex(buf.data(), len);
+  }
+
+  // names in a dir, but "." and ".."
+  static std::vector<std::string> _list(std::string const& path) {
+    std::vector<std::string> names;
+    DIR* d = opendir(path.c_str());
+
+    if (d == nullptr) {
+      return names;
+    }
+
+    dirent* e;
+
+    while ((e = readdir(d)) != nullptr) {
+      std::string name = e->d_name;
+
+      if (name != "." && name != "..") {
+	names.push_back(name);
+      }
+    }
+
+    closedir(d);
+    return names;
+  }
+
+  std::string _registry() const {
+    return this->dir + "/manifests";
+  }
+
+  std::string _lock_path() const {
+    return this->dir + "/.lock";
+  }
+
+  // read the store's key, making one up the first time
+  bool _load_key() {
+    std::string path = this->dir + "/.key";
+    std::string tmp = this->dir + "/.key.XXXXXX";
+    std::vector<unsigned char> fresh(key_len);
+
+    if (access(path.c_str(), F_OK) == -1) {
+      int fd = -1;
+      std::vector<char> name(tmp.begin(), tmp.end());
+      name.push_back('\0');
+
+      if (RAND_bytes(fresh.data(), key_len) != 1 || (fd = mkstemp(name.data())) == -1) {
+	return false;
+      }
+
+      bool ok = write(fd, fresh.data(), key_len) == (ssize_t)key_len && fsync(fd) == 0;
+      ok = (close(fd) == 0) && ok;
+
+      // (link() won't replace a key someone else just made)
+      if (ok) {
+	link(name.data(), path.c_str());
+      }
+
+      unlink(name.data());
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+      return false;
+    }
+
+    this->key.resize(key_len);
+    bool ok = read(fd, &this->key[0], key_len) == (ssize_t)key_len;
+    close(fd);
+    return ok;
+  }
+
+  // HMAC-SHA256 of `data` under the store's key, in hex (empty on failure)
+  std::string _mac(char const* data, size_t len) const {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+
+    if (HMAC(EVP_sha256(), this->key.data(), this->key.size(), (unsigned char const*)data,
+	     len, md, &md_len) == nullptr) {
+      return std::string();
+    }
+
+    return _hex(md, md_len);
+  }
+
+  // open a chunk (checking it's whole) and start reading it in
+  int _open_chunk(Manifest::Entry const& e) const {
+    int fd = ::open(this->path_for(e.hash).c_str(), O_RDONLY);
+    struct stat st;
+
+    if (fd != -1 && (fstat(fd, &st) == -1 || (uint64_t)st.st_size != e.len)) {
+      close(fd);
+      return -1;
+    }
+
+    if (fd != -1) {
+      posix_fadvise(fd, 0, e.len, POSIX_FADV_WILLNEED);
+    }
+
+    return fd;
+  }
+
+  std::string dir;
+  std::string key;
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Inflater.hpp: class for decompressing a MODE Z upload as it arrives
+*/
+#ifndef INFLATER_HPP
+#define INFLATER_HPP 1
+
+#include <string>
+#include <functional>
+#include <zlib.h>
+
+// undoes one zlib (RFC 1950) stream fed to it in arbitrary pieces
+class Inflater {
+public:
+  typedef std::function<bool(char const*, size_t)> Sink;
+
+  explicit Inflater(Sink const& sink_) : zs(), out(256 * 1024, '\0'), sink(sink_),
+    done(false) {
+    this->ok = inflateInit(&this->zs) == Z_OK;
+  }
+
+  // decompress `len` more bytes into `sink`; false on corrupt input or if
+  // `sink` fails (anything after the end of the stream is ignored)
+  bool feed(char const* buf, size_t len) {
+    this->zs.next_in = (Bytef*)buf;
+    this->zs.avail_in = len;
+
+    while (this->ok && !this->done && this->zs.avail_in > 0) {
+      this->zs.next_out = (Bytef*)&this->out[0];
+      this->zs.avail_out = this->out.size();
+
+      int res = inflate(&this->zs, Z_NO_FLUSH);
+      size_t produced = this->out.size() - this->zs.avail_out;
+
+      if (res == Z_STREAM_END) {
+	this->done = true;
+      } else if (res != Z_OK && res != Z_BUF_ERROR) {
+	this->ok = false;
+      }
+
+      if (this->ok && produced > 0) {
+	this->ok = this->sink(this->out.data(), produced);
+      } else if (res == Z_BUF_ERROR) {
+	// no progress possible until more input comes
+	break;
+      }
+    }
+
+    return this->ok;
+  }
+
+  // has the whole stream come through?
+  bool finished() const {
+    return this->done;
+  }
+
+  // cleanup
+  virtual ~Inflater() {
+    inflateEnd(&this->zs);
+  }
+
+private:
+  Inflater(Inflater const&) = delete;
+  Inflater& operator=(Inflater const&) = delete;
+
+  z_stream zs;
+  std::string out;
+  Sink sink;
+  bool ok;
+  bool done;
+};
+
+#endif
@@ -0,0 +1,175 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+ListingCache.hpp: class for caching LIST output
+*/
+#ifndef LISTINGCACHE_HPP
+#define LISTINGCACHE_HPP 1
+
+#include <string>
+#include <unordered_map>
+#include <dirent.h>
+#include "Watcher.hpp"
+#include "PathResolver.hpp"
+
+// keeps `ls` output per (dir, options) for as long as the watcher says
+// neither the dir nor any of its subdirs (whose size, mtime and link count
+// show up in it) has changed
+class ListingCache {
+public:
+  explicit ListingCache(Watcher& watcher_, size_t max_bytes_=16 * 1024 * 1024) :
+    watcher(watcher_), max_bytes(max_bytes_), bytes(0), generation(0) {
+    watcher_.subscribe([this](std::string const& dir, std::string const& name) {
+	if (dir.empty()) {
+	  this->clear();
+	} else {
+	  this->invalidate(dir, name.empty());
+	  this->invalidate(_parent(dir), false);
+	}
+      });
+  }
+
+  // can `ls` with these options be cached at all? not if it reaches past
+  // the dir's own entries (-R), or shows what symlinks point to (-L)
+  static bool cacheable(std::string const& opt) {
+    return opt.find_first_of("RL") == std::string::npos;
+  }
+
+  bool get(std::string const& dir, std::string const& opt, std::string& out) const {
+    auto d = this->listings.find(dir);
+
+    if (d == this->listings.end()) {
+      return false;
+    }
+
+    auto o = d->second.find(opt);
+
+    if (o == d->second.end()) {
+      return false;
+    }
+
+    out = o->second;
+    return true;
+  }
+
+  // call before running `ls` on `dir`: starts watching it and its subdirs,
+  // and returns the epoch to hand back to put() (it changes on every
+  // invalidation)
+  unsigned long begin(std::string const& dir) {
+    this->_watch(dir);
+    return this->generation;
+  }
+
+  // cache a listing, unless something changed since begin() or `dir` can't be watched
+  bool put(std::string const& dir, std::string const& opt,
+	   std::string const& listing, unsigned long epoch_) {
+    this->watcher.poll();
+
+    if (epoch_ != this->generation || listing.size() > this->max_bytes ||
+	!cacheable(opt) || !this->_watch(dir)) {
+      return false;
+    }
+
+    // make room by dropping whole dirs
+    while (this->bytes + listing.size() > this->max_bytes && !this->listings.empty()) {
+      this->_erase(this->listings.begin());
+    }
+
+    std::string& slot = this->listings[dir][opt];
+    this->bytes -= slot.size();
+    slot = listing;
+    this->bytes += slot.size();
+    return true;
+  }
+
+  // drop the listings of `dir` (and everything below it, if `subtree`)
+  void invalidate(std::string const& dir, bool subtree) {
+    this->generation++;
+
+    if (!subtree) {
+      auto d = this->listings.find(dir);
+
+      if (d != this->listings.end()) {
+	this->_erase(d);
+      }
+
+      return;
+    }
+
+    for (auto d = this->listings.begin(); d != this->listings.end(); ) {
+      std::string const& cached = d->first;
+
+      if (PathResolver::begins_with(cached, dir) &&
+	  (cached.size() == dir.size() || cached[dir.size()] == '/')) {
+	d = this->_erase(d);
+      } else {
+	++d;
+      }
+    }
+  }
+
+  void clear() {
+    this->generation++;
+    this->listings.clear();
+    this->bytes = 0;
+  }
+
+private:
+  static std::string _parent(std::string const& dir) {
+    size_t slash = dir.rfind('/');
+    return (slash == 0 || slash == std::string::npos ? "/" : dir.substr(0, slash));
+  }
+
+  // watch `dir` and every dir right below it; false if any can't be
+  bool _watch(std::string const& dir) {
+    if (!this->watcher.watch(dir)) {
+      return false;
+    }
+
+    DIR* d = opendir(dir.c_str());
+
+    if (d == nullptr) {
+      return false;
+    }
+
+    bool ok = true;
+    dirent* e;
+
+    while (ok && (e = readdir(d)) != nullptr) {
+      std::string name = e->d_name;
+
+      if (name == "." || name == "..") {
+	continue;
+      }
+
+      std::string path = (dir == "/" ? dir : dir + '/') + name;
+      struct stat st;
+
+      if (e->d_type == DT_DIR ||
+	  (e->d_type == DT_UNKNOWN && lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+	ok = this->watcher.watch(path);
+      }
+    }
+
+    closedir(d);
+    return ok;
+  }
+
+  typedef std::unordered_map<std::string, std::unordered_map<std::string, std::string> > Listings;
+
+  Listings::iterator _erase(Listings::iterator d) {
+    for (auto const& o : d->second) {
+      this->bytes -= o.second.size();
+    }
+
+    return this->listings.erase(d);
+  }
+
+  Watcher& watcher;
+  size_t max_bytes;
+  size_t bytes;
+  unsigned long generation;
+  Listings listings;
+};
+
+#endif
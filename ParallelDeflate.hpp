@@ -0,0 +1,219 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+ParallelDeflate.hpp: class for compressing a stream on a thread pool
+*/
+#ifndef PARALLELDEFLATE_HPP
+#define PARALLELDEFLATE_HPP 1
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <zlib.h>
+#include "Ascii.hpp"
+#include "ThreadPool.hpp"
+
+// produces one zlib (RFC 1950) stream while the pool does the work: the
+// input is cut into blocks that are raw-deflated independently, each primed
+// with the 32KiB before it so the ratio hardly suffers and ended on a byte
+// boundary (Z_SYNC_FLUSH) so the pieces can simply be concatenated; the
+// blocks' adler32s are combined for the trailer (the trick pigz uses); the
+// caller only reads the input and passes compressed blocks on, in order
+class ParallelDeflate {
+public:
+  // like read(): bytes read, 0 at the end, -1 on error
+  typedef std::function<ssize_t(char*, size_t)> Source;
+  typedef std::function<bool(char const*, size_t)> Sink;
+
+  // `ascii`: turn LFs into CRLFs before compressing (TYPE A)
+  ParallelDeflate(ThreadPool& pool_, int level_, bool ascii_) :
+    pool(pool_), level(level_), ascii(ascii_) {
+  }
+
+  // compress everything `source` has into `sink`; returns the number of
+  // bytes read from `source`, and sets `ok` if all of it went out
+  uint64_t run(Source const& source, Sink const& sink, bool& ok) {
+    std::deque<std::shared_ptr<Block> > inflight;
+    std::string tail;
+    uint64_t consumed = 0;
+    uLong adler = adler32(0, Z_NULL, 0);
+    bool eof = false;
+
+    unsigned char header[2] = { 0x78, _header_flags(this->level) };
+    ok = sink((char const*)header, sizeof(header));
+
+    while (ok && (!eof || !inflight.empty())) {
+      // keep every pool thread busy, and the next block ready behind it
+      while (!eof && inflight.size() < 2 * this->pool.size()) {
+	std::shared_ptr<Block> b = std::make_shared<Block>();
+
+	if (!this->_fill(source, *b, eof)) {
+	  ok = false;
+	  return consumed;
+	}
+
+	consumed += b->raw;
+	b->dict = tail;
+	b->last = eof;
+
+	tail += b->in;
+
+	if (tail.size() > window) {
+	  tail.erase(0, tail.size() - window);
+	}
+
+	int lvl = this->level;
+	this->pool.submit([b, lvl] { _compress(*b, lvl); });
+	inflight.push_back(b);
+      }
+
+      // blocks go out in order, as soon as each is done
+      std::shared_ptr<Block> b = inflight.front();
+      inflight.pop_front();
+
+      {
+	std::unique_lock<std::mutex> lock(b->mtx);
+	b->cv.wait(lock, [&] { return b->done; });
+      }
+
+      ok = b->ok && sink(b->out.data(), b->out.size());
+      adler = adler32_combine(adler, b->adler, b->in.size());
+    }
+
+    // (blocks still queued after a failure keep themselves alive)
+    if (ok) {
+      unsigned char trailer[4] = {
+	(unsigned char)(adler >> 24), (unsigned char)(adler >> 16),
+	(unsigned char)(adler >> 8), (unsigned char)adler
+      };
+      ok = sink((char const*)trailer, sizeof(trailer));
+    }
+
+    return consumed;
+  }
+
+  // compress a small buffer in one go (LIST output)
+  static bool compress(std::string const& in, int level, std::string& out) {
+    uLongf len = compressBound(in.size());
+    out.resize(len);
+
+    if (compress2((Bytef*)&out[0], &len, (Bytef const*)in.data(), in.size(), level) != Z_OK) {
+      return false;
+    }
+
+    out.resize(len);
+    return true;
+  }
+
+private:
+  ParallelDeflate(ParallelDeflate const&) = delete;
+  ParallelDeflate& operator=(ParallelDeflate const&) = delete;
+
+  static const size_t block_size = 128 * 1024;
+  // deflate's window: how far back a block can refer
+  static const size_t window = 32 * 1024;
+
+  struct Block {
+    std::string dict;
+    std::string in;
+    size_t raw;
+    bool last;
+
+    std::string out;
+    uLong adler;
+    bool ok;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done;
+
+    Block() : raw(0), last(false), adler(0), ok(false), done(false) {
+    }
+  };
+
+  // the FLEVEL bits of the zlib header, with FCHECK to make it valid
+  static unsigned char _header_flags(int level) {
+    if (level >= 0 && level < 2) {
+      return 0x01;
+    } else if (level >= 2 && level < 6) {
+      return 0x5e;
+    } else if (level == 6 || level == Z_DEFAULT_COMPRESSION) {
+      return 0x9c;
+    } else {
+      return 0xda;
+    }
+  }
+
+  // read the next block (converted, for ASCII); sets `eof` if that was all
+  bool _fill(Source const& source, Block& b, bool& eof) const {
+    std::string raw(block_size, '\0');
+
+    while (b.raw < block_size) {
+      ssize_t cnt = source(&raw[b.raw], block_size - b.raw);
+
+      if (cnt < 0) {
+	return false;
+      } else if (cnt == 0) {
+	eof = true;
+	break;
+      }
+
+      b.raw += cnt;
+    }
+
+    raw.resize(b.raw);
+
+    if (this->ascii) {
+      b.in.resize(2 * raw.size());
+      b.in.resize(Ascii::encode(raw.data(), raw.size(), &b.in[0]));
+    } else {
+      b.in.swap(raw);
+    }
+
+    return true;
+  }
+
+  // pool thread: raw-deflate one block
+  static void _compress(Block& b, int level) {
+    z_stream zs { };
+    bool ok = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    if (ok && !b.dict.empty()) {
+      ok = deflateSetDictionary(&zs, (Bytef const*)b.dict.data(), b.dict.size()) == Z_OK;
+    }
+
+    if (ok) {
+      // room for the flush marker / final block on top of the bound
+      b.out.resize(deflateBound(&zs, b.in.size()) + 64);
+      zs.next_in = (Bytef*)b.in.data();
+      zs.avail_in = b.in.size();
+      zs.next_out = (Bytef*)&b.out[0];
+      zs.avail_out = b.out.size();
+
+      int res = deflate(&zs, b.last ? Z_FINISH : Z_SYNC_FLUSH);
+      ok = (b.last ? res == Z_STREAM_END : res == Z_OK && zs.avail_out > 0) && zs.avail_in == 0;
+      b.out.resize(zs.total_out);
+    }
+
+    deflateEnd(&zs);
+    b.adler = adler32(adler32(0, Z_NULL, 0), (Bytef const*)b.in.data(), b.in.size());
+
+    {
+      std::lock_guard<std::mutex> lock(b.mtx);
+      b.ok = ok;
+      b.done = true;
+    }
+
+    b.cv.notify_all();
+  }
+
+  ThreadPool& pool;
+  int level;
+  bool ascii;
+};
+
+#endif
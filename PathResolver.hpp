@@ -0,0 +1,399 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+PathResolver.hpp: class for mapping client paths into the sandbox
+*/
+#ifndef PATHRESOLVER_HPP
+#define PATHRESOLVER_HPP 1
+
+#include <string>
+#include <vector>
+#include <list>
+#include <utility>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+#include <linux/openat2.h>
+#include "Watcher.hpp"
+
+// resolves virtual paths ("/" == the sandbox root) to real paths, with a
+// bounded LRU cache of already-resolved entries (like the kernel's dcache)
+class PathResolver {
+public:
+  explicit PathResolver(std::string const& real_root_, size_t capacity_=1024) :
+    real_root(real_root_), prefix(real_root_ == "/" ? "" : real_root_),
+    capacity(capacity_), watcher(nullptr),
+    root_fd(::open(real_root_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC)) {
+  }
+
+  // from now on, only cache entries whose dir `w` is watching, and drop
+  // them as soon as it reports a change
+  void attach(Watcher& w) {
+    this->watcher = &w;
+    w.subscribe([this](std::string const& dir, std::string const& name) {
+	this->invalidate(name.empty() ? dir : _join(dir, name));
+      });
+  }
+
+  // join `path` onto the virtual dir `cwd`, collapsing ".", ".." and
+  // repeated slashes; ".." never climbs above "/"
+  static std::string normalize(std::string const& cwd, std::string const& path) {
+    std::vector<std::string> parts;
+
+    if (path.empty() || path[0] != '/') {
+      _split(cwd, parts);
+    }
+
+    _split(path, parts);
+
+    if (parts.empty()) {
+      return "/";
+    }
+
+    std::string out;
+
+    for (auto const& part : parts) {
+      out += '/';
+      out += part;
+    }
+
+    return out;
+  }
+
+  // map a virtual path to the real path of an existing entry
+  bool resolve(std::string const& vpath, std::string& real) {
+    Dentry const* hit = this->_cached(vpath);
+
+    if (hit != nullptr) {
+      real = hit->real;
+      return true;
+    }
+
+    Dentry d;
+
+    if (!this->_lookup(vpath, d, 0)) {
+      return false;
+    }
+
+    real = d.real;
+    return true;
+  }
+
+  // same as resolve(), but the entry has to be a directory
+  bool resolve_dir(std::string const& vpath, std::string& real) {
+    Dentry const* hit = this->_cached(vpath);
+
+    if (hit != nullptr) {
+      real = hit->real;
+      return hit->is_dir;
+    }
+
+    Dentry d;
+
+    if (!this->_lookup(vpath, d, 0) || !d.is_dir) {
+      return false;
+    }
+
+    real = d.real;
+    return true;
+  }
+
+  // resolve everything but the last component, which is appended as-is
+  // (it may not exist yet, and a symlink there is not followed); used by
+  // commands that create or remove directory entries
+  bool resolve_parent(std::string const& vpath, std::string& real) {
+    if (vpath == "/") {
+      return false;
+    }
+
+    size_t slash = vpath.rfind('/');
+    std::string parent = (slash == 0 ? "/" : vpath.substr(0, slash));
+
+    std::string dir;
+
+    if (!this->resolve_dir(parent, dir)) {
+      return false;
+    }
+
+    real = _join(dir, vpath.substr(slash + 1));
+    return true;
+  }
+
+  // open a resolved real path without following a symlink anywhere on the
+  // way: they were all expanded when it was resolved, so one that's there
+  // now was swapped in since, and may point out of the sandbox
+  int open(std::string const& real, int flags, mode_t mode=0) const {
+    if (!this->contains(real)) {
+      errno = EACCES;
+      return -1;
+    }
+
+    if (this->root_fd != -1) {
+      std::string rel = real.substr(std::min(real.size(), this->prefix.size() + 1));
+      open_how how { };
+      how.flags = flags | O_CLOEXEC;
+      how.mode = ((flags & O_CREAT) ? mode : 0);
+      how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+      int fd = syscall(SYS_openat2, this->root_fd, (rel.empty() ? "." : rel.c_str()), &how,
+		       sizeof(how));
+
+      if (fd != -1 || errno != ENOSYS) {
+	return fd;
+      }
+    }
+
+    // (kernels before 5.6: at least the last component can't be a link)
+    return ::open(real.c_str(), flags | O_NOFOLLOW | O_CLOEXEC, mode);
+  }
+
+  // is the real path inside the sandbox?
+  bool contains(std::string const& real) const {
+    if (this->prefix.empty()) {
+      return !real.empty() && real[0] == '/';
+    }
+
+    return begins_with(real, this->real_root) &&
+      (real.size() == this->real_root.size() || real[this->real_root.size()] == '/');
+  }
+
+  // "fakify" a path (long path -> short path)
+  std::string fakify(std::string const& real) const {
+    if (real.empty() || real == this->real_root || !this->contains(real)) {
+      return "/";
+    }
+
+    return real.substr(this->prefix.length(), std::string::npos);
+  }
+
+  // forget every entry whose resolution went through a real path or
+  // anything below it (it changed on disk); an empty path forgets everything
+  void invalidate(std::string const& real) {
+    for (auto it = this->lru.begin(); it != this->lru.end(); ) {
+      if (_passes_through(it->second, real)) {
+	this->index.erase(it->first);
+	it = this->lru.erase(it);
+      } else {
+	++it;
+      }
+    }
+  }
+
+  // forget everything
+  void clear() {
+    this->index.clear();
+    this->lru.clear();
+  }
+
+  size_t size() const {
+    return this->lru.size();
+  }
+
+  std::string const& root() const {
+    return this->real_root;
+  }
+
+  static bool begins_with(std::string const& input, std::string const& match) {
+    return input.size() >= match.size() &&
+      std::equal(match.begin(), match.end(), input.begin());
+  }
+
+  // cleanup
+  virtual ~PathResolver() {
+    if (this->root_fd != -1) {
+      close(this->root_fd);
+    }
+  }
+
+private:
+  PathResolver(PathResolver const&) = delete;
+  PathResolver& operator=(PathResolver const&) = delete;
+
+  struct Dentry {
+    std::string real;
+    bool is_dir;
+    // where the symlinks it took to get here live (their own locations,
+    // not their targets'), and whether every dir on the way is watched
+    std::vector<std::string> via;
+    bool tracked;
+  };
+
+  typedef std::list<std::pair<std::string, Dentry> > LruList;
+
+  // same limit the kernel uses for nested symlinks
+  static const int max_symlinks = 40;
+
+  // split a path on '/' into `parts`, applying "." and ".."
+  static void _split(std::string const& path, std::vector<std::string>& parts) {
+    size_t pos = 0;
+
+    while (pos <= path.size()) {
+      size_t end = path.find('/', pos);
+
+      if (end == std::string::npos) {
+	end = path.size();
+      }
+
+      std::string part = path.substr(pos, end - pos);
+
+      if (part == "..") {
+	if (!parts.empty()) {
+	  parts.pop_back();
+	}
+      } else if (!part.empty() && part != ".") {
+	parts.push_back(part);
+      }
+
+      pos = end + 1;
+    }
+  }
+
+  static std::string _join(std::string const& dir, std::string const& name) {
+    return (dir == "/" ? dir : dir + '/') + name;
+  }
+
+  // is `path` at or below `real`?
+  static bool _below(std::string const& path, std::string const& real) {
+    return begins_with(path, real) && (path.size() == real.size() || path[real.size()] == '/');
+  }
+
+  static bool _passes_through(Dentry const& d, std::string const& real) {
+    if (_below(d.real, real)) {
+      return true;
+    }
+
+    for (auto const& v : d.via) {
+      if (_below(v, real)) {
+	return true;
+      }
+    }
+
+    return false;
+  }
+
+  // the cached entry for a virtual path (and mark it recently used)
+  Dentry const* _cached(std::string const& vpath) {
+    auto cached = this->index.find(vpath);
+
+    if (cached == this->index.end()) {
+      return nullptr;
+    }
+
+    this->lru.splice(this->lru.begin(), this->lru, cached->second);
+    return &cached->second->second;
+  }
+
+  // resolve a normalized virtual path one component at a time, consulting
+  // the cache first; symlinks are expanded lexically inside the sandbox
+  bool _lookup(std::string const& vpath, Dentry& out, int depth) {
+    if (vpath == "/") {
+      out.real = this->real_root;
+      out.is_dir = true;
+      out.via.clear();
+      out.tracked = true;
+      return true;
+    }
+
+    Dentry const* hit = this->_cached(vpath);
+
+    if (hit != nullptr) {
+      out = *hit;
+      return true;
+    }
+
+    size_t slash = vpath.rfind('/');
+    std::string parent = (slash == 0 ? "/" : vpath.substr(0, slash));
+    Dentry dir;
+
+    if (!this->_lookup(parent, dir, depth) || !dir.is_dir) {
+      return false;
+    }
+
+    std::string real = _join(dir.real, vpath.substr(slash + 1));
+
+    // watch before looking, so a change right after the lstat() is seen
+    bool tracked = dir.tracked && this->watcher != nullptr && this->watcher->watch(dir.real);
+    struct stat st;
+
+    if (lstat(real.c_str(), &st) == -1) {
+      return false;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+      if (depth >= max_symlinks) {
+	return false;
+      }
+
+      char tmp[PATH_MAX + 1] { };
+      ssize_t len = readlink(real.c_str(), tmp, PATH_MAX);
+
+      if (len <= 0) {
+	return false;
+      }
+
+      std::string target(tmp, len);
+      std::string vtarget;
+
+      if (target[0] == '/') {
+	// absolute links have to point back into the sandbox
+	target = normalize("/", target);
+
+	if (!this->contains(target)) {
+	  return false;
+	}
+
+	vtarget = this->fakify(target);
+      } else {
+	// relative links are relative to the dir holding them
+	vtarget = normalize(this->fakify(dir.real), target);
+      }
+
+      if (!this->_lookup(vtarget, out, depth + 1)) {
+	return false;
+      }
+
+      tracked = tracked && out.tracked;
+      out.via.insert(out.via.end(), dir.via.begin(), dir.via.end());
+      out.via.push_back(real);
+    } else {
+      // (the dirs on the way are all above `real` itself)
+      out.real = real;
+      out.is_dir = S_ISDIR(st.st_mode);
+      out.via.swap(dir.via);
+    }
+
+    out.tracked = tracked;
+
+    if (tracked || this->watcher == nullptr) {
+      this->_insert(vpath, out);
+    }
+
+    return true;
+  }
+
+  void _insert(std::string const& vpath, Dentry const& d) {
+    this->lru.push_front(std::make_pair(vpath, d));
+    this->index[vpath] = this->lru.begin();
+
+    if (this->lru.size() > this->capacity) {
+      this->index.erase(this->lru.back().first);
+      this->lru.pop_back();
+    }
+  }
+
+  std::string real_root;
+  std::string prefix;
+  size_t capacity;
+  Watcher* watcher;
+  int root_fd;
+
+  LruList lru;
+  std::unordered_map<std::string, LruList::iterator> index;
+};
+
+#endif
@@ -0,0 +1,210 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+ReadAhead.hpp: class for streaming cold files to a socket
+*/
+#ifndef READAHEAD_HPP
+#define READAHEAD_HPP 1
+
+#include <cstdint>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "Ascii.hpp"
+#include "Channel.hpp"
+
+// sends a file that isn't in the page cache: a reader thread fills one
+// buffer while the caller sends the other, and the kernel is told to read
+// a window ahead of the reader; files too big to keep cached are dropped
+// from the page cache behind the cursor so they don't evict everyone else;
+// in `ascii` mode, LFs are sent as CRLFs; only the first `size_` bytes go
+// out, so a file that grows while it's sent isn't an error
+class ReadAhead {
+public:
+  ReadAhead(int fd_, uint64_t size_, size_t window_, bool ascii_=false) :
+    fd(fd_), size(size_), window(window_ < 2 * min_chunk ? 2 * min_chunk : window_),
+    chunk(this->window / 2), drop_behind(size_ > _phys_mem() / 4),
+    ascii(ascii_), stop(false) {
+    for (auto& b : this->bufs) {
+      b.data.resize(this->chunk);
+      b.len = 0;
+      b.offset = 0;
+      b.full = false;
+    }
+  }
+
+  // is the first window of the file already in the page cache?
+  static bool resident(int fd, uint64_t size, size_t window) {
+    size_t len = (size < window ? size : window);
+
+    if (len == 0) {
+      return true;
+    }
+
+    void* map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+      return false;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((len + page - 1) / page);
+    bool hot = mincore(map, len, pages.data()) == 0;
+
+    for (size_t i = 0; hot && i < pages.size(); i++) {
+      hot = (pages[i] & 1);
+    }
+
+    munmap(map, len);
+    return hot;
+  }
+
+  // stream the file to `out`; returns the number of file bytes sent, which
+  // is short of `size` if reading or sending failed (or the file shrank)
+  uint64_t send_to(Channel const& out) {
+    std::vector<char> encoded(this->ascii ? 2 * this->chunk : 0);
+
+    posix_fadvise(this->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(this->fd, 0, this->window, POSIX_FADV_WILLNEED);
+
+    std::thread reader(&ReadAhead::_read_loop, this);
+    uint64_t sent = 0;
+
+    for (unsigned i = 0; ; i ^= 1) {
+      Buffer& b = this->bufs[i];
+
+      {
+	std::unique_lock<std::mutex> lock(this->mtx);
+	this->cv.wait(lock, [&] { return b.full; });
+      }
+
+      // an empty buffer marks the end of the file (or a read error)
+      if (b.len == 0) {
+	break;
+      }
+
+      bool ok;
+
+      if (this->ascii) {
+	size_t len = Ascii::encode(b.data.data(), b.len, encoded.data());
+	ok = out.send_all(encoded.data(), len);
+      } else {
+	ok = out.send_all(b.data.data(), b.len);
+      }
+
+      if (!ok) {
+	break;
+      }
+
+      sent += b.len;
+
+      if (this->drop_behind) {
+	posix_fadvise(this->fd, b.offset, b.len, POSIX_FADV_DONTNEED);
+      }
+
+      {
+	std::lock_guard<std::mutex> lock(this->mtx);
+	b.full = false;
+      }
+
+      this->cv.notify_all();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(this->mtx);
+      this->stop = true;
+    }
+
+    this->cv.notify_all();
+    reader.join();
+    return sent;
+  }
+
+private:
+  ReadAhead(ReadAhead const&) = delete;
+  ReadAhead& operator=(ReadAhead const&) = delete;
+
+  static const size_t min_chunk = 64 * 1024;
+
+  struct Buffer {
+    std::vector<char> data;
+    size_t len;
+    off_t offset;
+    bool full;
+  };
+
+  static uint64_t _phys_mem() {
+    return (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  }
+
+  // reader thread: fill the buffers in turn until EOF or `size`
+  void _read_loop() {
+    off_t off = 0;
+
+    for (unsigned i = 0; ; i ^= 1) {
+      Buffer& b = this->bufs[i];
+
+      {
+	std::unique_lock<std::mutex> lock(this->mtx);
+	this->cv.wait(lock, [&] { return !b.full || this->stop; });
+
+	if (this->stop) {
+	  return;
+	}
+      }
+
+      // keep the kernel a window ahead of us
+      readahead(this->fd, off + this->chunk, this->window);
+
+      size_t want = std::min<uint64_t>(this->chunk, this->size - off);
+      size_t len = 0;
+
+      while (len < want) {
+	ssize_t cnt = pread(this->fd, b.data.data() + len, want - len, off + len);
+
+	if (cnt == -1 && errno == EINTR) {
+	  continue;
+	} else if (cnt <= 0) {
+	  break;
+	}
+
+	len += cnt;
+      }
+
+      {
+	std::lock_guard<std::mutex> lock(this->mtx);
+	b.len = len;
+	b.offset = off;
+	b.full = true;
+      }
+
+      this->cv.notify_all();
+
+      if (len == 0) {
+	return;
+      }
+
+      off += len;
+    }
+  }
+
+  int fd;
+  uint64_t size;
+  size_t window;
+  size_t chunk;
+  bool drop_behind;
+  bool ascii;
+
+  Buffer bufs[2];
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stop;
+};
+
+#endif
@@ -0,0 +1,254 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+SegmentedUpload.hpp: class for uploading one file over several connections
+*/
+#ifndef SEGMENTEDUPLOAD_HPP
+#define SEGMENTEDUPLOAD_HPP 1
+
+#include <cstdint>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "Channel.hpp"
+
+// one byte range of a file that is uploaded in pieces, possibly by several
+// sessions (or worker processes) at once: every range is pwrite()'d into a
+// preallocated ".<name>.part" file, finished ranges are logged to
+// ".<name>.part.map", and whoever completes the last range renames the
+// part file over the target; the map starts with the upload's owner and
+// size, and only ranges logged under the same header count, so a new
+// upload never inherits bytes an abandoned one left behind
+class SegmentedUpload {
+public:
+  SegmentedUpload(std::string const& target_, std::string const& owner_, uint64_t offset_,
+		  uint64_t length_, uint64_t total_) :
+    target(target_), owner(owner_), offset(offset_), length(length_), total(total_),
+    pfd(-1) {
+    size_t slash = target_.rfind('/');
+    std::string dir = target_.substr(0, slash + 1);
+    std::string name = target_.substr(slash + 1);
+    this->part = dir + '.' + name + ".part";
+    this->map = this->part + ".map";
+  }
+
+  // is the range sane?
+  static bool valid_range(uint64_t offset, uint64_t length, uint64_t total) {
+    return length > 0 && offset < total && length <= total - offset;
+  }
+
+  // open the part file, creating and preallocating it if we're first;
+  // whatever another owner (or an upload of another size) left behind is
+  // thrown away first
+  bool open() {
+    int mfd = ::open(this->map.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW, 0644);
+
+    if (mfd == -1) {
+      return false;
+    }
+
+    if (flock(mfd, LOCK_EX) == -1) {
+      close(mfd);
+      return false;
+    }
+
+    std::string header = this->_header();
+
+    if (_read_all(mfd).compare(0, header.size(), header) != 0) {
+      // (unlinked, not truncated: a session still writing into the old
+      // part file can't touch the new one)
+      unlink(this->part.c_str());
+
+      if (ftruncate(mfd, 0) == -1 ||
+	  pwrite(mfd, header.data(), header.size(), 0) != (ssize_t)header.size()) {
+	close(mfd);
+	return false;
+      }
+    }
+
+    this->pfd = ::open(this->part.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW, 0644);
+    close(mfd);
+
+    if (this->pfd == -1) {
+      return false;
+    }
+
+    struct stat st;
+
+    if (fstat(this->pfd, &st) == -1) {
+      return false;
+    }
+
+    if ((uint64_t)st.st_size != this->total) {
+      if (st.st_size != 0) {
+	return false;
+      }
+
+      if (posix_fallocate(this->pfd, 0, this->total) != 0 &&
+	  ftruncate(this->pfd, this->total) == -1) {
+	return false;
+      }
+    }
+
+    return true;
+  }
+
+  // copy our range from the data connection into the part file; returns
+  // the number of bytes written, which is `length` unless something failed
+  uint64_t receive(Channel const& in) {
+    std::vector<char> buf(256 * 1024);
+    uint64_t done = 0;
+
+    while (done < this->length) {
+      size_t want = std::min<uint64_t>(buf.size(), this->length - done);
+      ssize_t cnt = in.recv(buf.data(), want);
+
+      if (cnt <= 0) {
+	break;
+      }
+
+      for (ssize_t put = 0; put < cnt; ) {
+	ssize_t w = pwrite(this->pfd, buf.data() + put, cnt - put, this->offset + done + put);
+
+	if (w == -1) {
+	  if (errno == EINTR) {
+	    continue;
+	  }
+
+	  return done;
+	}
+
+	put += w;
+      }
+
+      done += cnt;
+    }
+
+    return done;
+  }
+
+  // log our range as finished; sets `committed` if that completed the file
+  // and it was renamed into place
+  bool finish(bool& committed) {
+    committed = false;
+
+    if (fdatasync(this->pfd) == -1) {
+      return false;
+    }
+
+    int mfd = ::open(this->map.c_str(), O_RDWR | O_APPEND | O_NOFOLLOW);
+
+    if (mfd == -1) {
+      return false;
+    }
+
+    // serialize against sibling sessions finishing their own ranges
+    if (flock(mfd, LOCK_EX) == -1) {
+      close(mfd);
+      return false;
+    }
+
+    // still ours? (a different upload may have taken the target over)
+    std::string log = _read_all(mfd);
+    struct stat ours, now;
+
+    if (log.compare(0, this->_header().size(), this->_header()) != 0 ||
+	fstat(this->pfd, &ours) == -1 || stat(this->part.c_str(), &now) == -1 ||
+	ours.st_ino != now.st_ino || ours.st_dev != now.st_dev) {
+      close(mfd);
+      return false;
+    }
+
+    std::stringstream line;
+    line << this->offset << ' ' << this->length << '\n';
+    std::string entry = line.str();
+    bool ok = write(mfd, entry.data(), entry.size()) == (ssize_t)entry.size();
+
+    if (ok && this->_complete(log + entry)) {
+      ok = rename(this->part.c_str(), this->target.c_str()) == 0;
+
+      if (ok) {
+	unlink(this->map.c_str());
+	committed = true;
+      }
+    }
+
+    close(mfd);
+    return ok;
+  }
+
+  // cleanup
+  virtual ~SegmentedUpload() {
+    if (this->pfd != -1) {
+      close(this->pfd);
+    }
+  }
+
+private:
+  SegmentedUpload(SegmentedUpload const&) = delete;
+  SegmentedUpload& operator=(SegmentedUpload const&) = delete;
+
+  // the map's first line
+  std::string _header() const {
+    std::stringstream ss;
+    ss << "upload " << this->owner << ' ' << this->total << '\n';
+    return ss.str();
+  }
+
+  static std::string _read_all(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t len;
+    off_t pos = 0;
+
+    while ((len = pread(fd, buf, sizeof(buf), pos)) > 0) {
+      out.append(buf, len);
+      pos += len;
+    }
+
+    return out;
+  }
+
+  // do the ranges logged in the map cover the whole file?
+  bool _complete(std::string const& log) const {
+    std::vector<std::pair<uint64_t, uint64_t> > ranges;
+    std::stringstream ss(log.substr(this->_header().size()));
+    uint64_t off, len_;
+
+    while (ss >> off >> len_) {
+      ranges.push_back(std::make_pair(off, off + len_));
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+    uint64_t covered = 0;
+
+    for (auto const& r : ranges) {
+      if (r.first > covered) {
+	return false;
+      }
+
+      covered = std::max(covered, r.second);
+    }
+
+    return covered >= this->total;
+  }
+
+  std::string target;
+  std::string owner;
+  std::string part;
+  std::string map;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t total;
+  int pfd;
+};
+
+#endif
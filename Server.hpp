@@ -7,19 +7,66 @@ Server.hpp: class for a FTP server
 #define SERVER_HPP 1
 
 #include <cstdint>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <iostream>
+#include <vector>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <linux/limits.h>
 #include <algorithm>
+#include "Config.hpp"
+#include "Tls.hpp"
+#include "Stats.hpp"
+#include "Trace.hpp"
+#include "DedupStore.hpp"
+#include "CompressCache.hpp"
+#include "ThreadPool.hpp"
 #include "Session.hpp"
 
 class Server {
 public:
-  Server(uint16_t port_) : sct(-1), port(port_) {
+  // `config_.workers` == 0 serves everything from this process, otherwise
+  // the server preforks that many worker processes
+  Server(uint16_t port_, Config const& config_) : sct(-1), port(port_),
+    config(config_), stats(std::max(config_.workers, 1u)) {
   }
 
-  // bind and listen
+  // load the certificate, open the trace, the dedup store and the
+  // compression cache (if any of them are configured), bind and listen
   bool initialize() {
+    if (!this->stats.valid()) {
+      return false;
+    }
+
+    if (!this->config.tls_cert.empty() &&
+	!this->tls.load(this->config.tls_cert, this->config.tls_key)) {
+      return false;
+    }
+
+    if (!this->config.trace_path.empty() && !this->trace.open(this->config.trace_path)) {
+      return false;
+    }
+
+    if (!this->config.dedup_store.empty()) {
+      if (!_outside_root(this->config.dedup_store) ||
+	  !this->dedup.open(this->config.dedup_store)) {
+	return false;
+      }
+
+      // whatever uploads replaced while we were down
+      this->dedup.collect(true);
+    }
+
+    if (!this->config.zcache_dir.empty() && (!_outside_root(this->config.zcache_dir) ||
+	!this->zcache.open(this->config.zcache_dir, this->config.zcache_budget))) {
+      return false;
+    }
+
     this->sct = socket(AF_INET, SOCK_STREAM, 0);
 
     if (this->sct == -1) {
@@ -39,8 +86,86 @@ public:
     return (listen(this->sct, SOMAXCONN) != 1);
   }
 
-  // accept connections on a single thread (this method never returns)
+  // serve connections (this method never returns)
   void start() {
+    if (this->config.workers == 0) {
+      this->_accept_loop(this->stats.slot(0));
+    } else {
+      this->_supervise();
+    }
+  }
+
+  // cleanup
+  virtual ~Server() {
+    if (this->sct != -1) {
+      close(this->sct);
+    }
+  }
+
+private:
+  // is `dir` (which may not exist yet) clear of the served tree? clients
+  // could otherwise overwrite or plant what the server keeps in it, or the
+  // server could delete their files
+  static bool _outside_root(std::string const& dir) {
+    char root[PATH_MAX + 1] { };
+    char real[PATH_MAX + 1] { };
+    std::string where = dir, name;
+
+    if (realpath(".", root) == nullptr) {
+      return false;
+    }
+
+    // a dir yet to be created is where its parent is
+    if (access(dir.c_str(), F_OK) == -1) {
+      size_t slash = dir.find_last_not_of('/');
+      slash = (slash == std::string::npos ? std::string::npos : dir.rfind('/', slash));
+      where = (slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash));
+      name = '/' + dir.substr(slash == std::string::npos ? 0 : slash + 1);
+    }
+
+    if (realpath(where.c_str(), real) == nullptr) {
+      return false;
+    }
+
+    std::string full = real;
+    full = (full == "/" && !name.empty() ? name : full + name);
+
+    if (PathResolver(root).contains(full) || PathResolver(full).contains(root)) {
+      std::cerr << dir << ": has to be outside the served tree" << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  // accept connections on a single thread (this method never returns)
+  void _accept_loop(Stats::Slot* slot) {
+    // caches shared by every session served from this process; they are
+    // set up here so each worker gets its own inotify instance
+    char root[PATH_MAX + 1] { };
+    realpath(".", root);
+
+    Watcher watcher;
+    PathResolver paths(root);
+    ListingCache listings(watcher);
+    paths.attach(watcher);
+
+    // MODE Z compresses on these, so they have to start after the fork too
+    unsigned nthreads = this->config.compress_threads;
+
+    if (nthreads == 0) {
+      nthreads = std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+    }
+
+    ThreadPool pool(nthreads);
+
+    TlsContext const* tls = (this->tls.valid() ? &this->tls : nullptr);
+    Trace* trace = (this->trace.valid() ? &this->trace : nullptr);
+    DedupStore const* dedup = (this->dedup.valid() ? &this->dedup : nullptr);
+    CompressCache const* zcache = (this->zcache.valid() ? &this->zcache : nullptr);
+    SessionContext ctx { &this->config, tls, slot, trace, dedup, &pool, zcache, &watcher,
+			 &paths, &listings };
+
     for (;;)
     {
       sockaddr_in sender;
@@ -48,21 +173,97 @@ public:
       int fd = accept(this->sct, (sockaddr*)&sender, &len);
 
       if (fd != -1) {
-	Session::create_session(fd, sender);
+	Session::create_session(fd, sender, ctx);
       }
     }
   }
 
-  // cleanup
-  virtual ~Server() {
-    if (this->sct != -1) {
-      close(this->sct);
+  // fork a worker that accepts on the shared listening socket
+  pid_t _spawn(unsigned i) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+      // go away together with the master (and right now, if it died before
+      // the death signal was armed); a stats request sent to the whole
+      // process group is the master's to answer
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+      if (getppid() != parent) {
+	_exit(0);
+      }
+
+      signal(SIGUSR1, SIG_IGN);
+      this->_accept_loop(this->stats.slot(i));
+    }
+
+    return pid;
+  }
+
+  // master process: keep `workers` children alive, and print the summed
+  // counters on SIGUSR1 (this method never returns)
+  void _supervise() {
+    struct sigaction sa;
+    std::fill((char*)&sa, (char*)&sa + sizeof(sa), 0);
+    sa.sa_handler = _on_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    std::vector<pid_t> pids(this->config.workers, -1);
+    std::vector<time_t> started(this->config.workers, 0);
+
+    for (;;)
+    {
+      for (unsigned i = 0; i < this->config.workers; i++) {
+	if (pids[i] == -1) {
+	  // don't spin if a worker keeps dying right away
+	  if (time(NULL) - started[i] < 1) {
+	    sleep(1);
+	  }
+
+	  started[i] = time(NULL);
+	  pids[i] = this->_spawn(i);
+	}
+      }
+
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+
+      if (pid == -1) {
+	if (errno == EINTR && dump_requested) {
+	  dump_requested = 0;
+	  std::cerr << this->stats.summary() << std::endl;
+	}
+
+	continue;
+      }
+
+      for (unsigned i = 0; i < this->config.workers; i++) {
+	if (pids[i] == pid) {
+	  std::cerr << "worker " << i << " (pid " << pid << ") exited, restarting"
+		    << std::endl;
+	  pids[i] = -1;
+	}
+      }
     }
   }
 
-private:
+  static void _on_sigusr1(int) {
+    dump_requested = 1;
+  }
+
+  static volatile sig_atomic_t dump_requested;
+
   int sct;
   uint16_t port;
+  Config config;
+  TlsContext tls;
+  Trace trace;
+  DedupStore dedup;
+  CompressCache zcache;
+  Stats stats;
 };
 
+volatile sig_atomic_t Server::dump_requested = 0;
+
 #endif
@@ -9,6 +9,7 @@ Session.hpp: class for a FTP server session
 #include <netdb.h>
 #include <string>
 #include <sstream>
+#include <vector>
 #include <algorithm>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,17 +21,55 @@ Session.hpp: class for a FTP server session
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include "PathResolver.hpp"
+#include "Watcher.hpp"
+#include "ListingCache.hpp"
+#include "SegmentedUpload.hpp"
+#include "Channel.hpp"
+#include "TransferTuner.hpp"
+#include "Tls.hpp"
+#include "ReadAhead.hpp"
+#include "Ascii.hpp"
+#include "Config.hpp"
+#include "Stats.hpp"
+#include "Trace.hpp"
+#include "DedupStore.hpp"
+#include "ThreadPool.hpp"
+#include "ParallelDeflate.hpp"
+#include "Inflater.hpp"
+#include "CompressCache.hpp"
+
+// per-process state that outlives a single session
+struct SessionContext {
+  Config const* config;
+  TlsContext const* tls;
+  Stats::Slot* stats;
+  Trace* trace;
+  DedupStore const* dedup;
+  ThreadPool* pool;
+  CompressCache const* zcache;
+  Watcher* watcher;
+  PathResolver* paths;
+  ListingCache* listings;
+};
 
 // represents an FTP session
 class Session {
 public:
   // the only accessible method from outside: runs an FTP session
-  static void create_session(int fd, sockaddr_in sender) {
-    Session sess(fd, sender);
+  static void create_session(int fd, sockaddr_in sender, SessionContext const& ctx) {
+    Stats::Slot::add(ctx.stats->sessions, 1);
+    Session sess(fd, sender, ctx);
     sess.interactive_prompt();
   }
 
 private:
+  // control-path microbenchmarks (bench_control.cpp) drive the internals
+  friend struct SessionBench;
+
   // start the session, and get input
   void interactive_prompt() {
     this->respond_with_code(220);
@@ -46,10 +85,10 @@ private:
 
     while (true) {
       char tmp;
-      int cnt = recv(this->fd, &tmp, 1, 0);
+      int cnt = this->ctrl.recv(&tmp, 1);
 
       if (cnt == -1) {
-	// read() failed
+	// recv() failed
 	this->running = false;
 	return;
       } else if (cnt == 0) {
@@ -76,6 +115,13 @@ private:
     std::string cmd;
     std::stringstream ss(line);
     std::getline(ss, cmd, ' ');
+    this->stats->count_command(cmd);
+
+    uint64_t started = Trace::now();
+    uint64_t moved = this->_bytes_moved();
+
+    // pick up changes to the filesystem before touching it
+    this->watcher.poll();
 
     if (cmd == "QUIT") {
       this->QUIT(cmd, ss);
@@ -105,9 +151,30 @@ private:
       this->STOR(cmd, ss);
     } else if (cmd == "RETR") {
       this->RETR(cmd, ss);
+    } else if (cmd == "SEGM") {
+      this->SEGM(cmd, ss);
+    } else if (cmd == "AUTH") {
+      this->AUTH(cmd, ss);
+    } else if (cmd == "PBSZ") {
+      this->PBSZ(cmd, ss);
+    } else if (cmd == "PROT") {
+      this->PROT(cmd, ss);
+    } else if (cmd == "OPTS") {
+      this->OPTS(cmd, ss);
     } else {
       this->respond_with_code(502);
     }
+
+    if (this->trace != nullptr) {
+      this->trace->record(this->trace_id, started, this->_bytes_moved() - moved, line);
+    }
+  }
+
+  // helper method: data bytes this process has moved so far (it serves one
+  // session at a time, so the difference across a command is that command's)
+  uint64_t _bytes_moved() const {
+    return this->stats->bytes_in.load(std::memory_order_relaxed) +
+      this->stats->bytes_out.load(std::memory_order_relaxed);
   }
 
   // helper method: send a string to the client
@@ -116,7 +183,7 @@ private:
       msg = msg + '\n';
     }
 
-    write(this->fd, msg.c_str(), msg.length());
+    this->ctrl.send_all(msg.data(), msg.length());
   }
 
   // helper method: send an error string to the client, given the code
@@ -134,7 +201,11 @@ private:
     case 125:
       return "125 Data connection already open; transfer starting.";
     case 150:
-      return "150 Opening Binary mode data connection.";
+      if (this->current_type == 'A') {
+	return "150 Opening ASCII mode data connection.";
+      } else {
+	return "150 Opening Binary mode data connection.";
+      }
     case 200:
       return "200 Command okay.";
     case 215:
@@ -245,7 +316,7 @@ private:
       return false;
     }
 
-    respond_with(std::string("257 \"") + this->fakify(this->_get_cwd()) + "\"");
+    respond_with(std::string("257 \"") + this->cwd + "\"");
     return true;
   }
 
@@ -281,19 +352,25 @@ private:
     std::getline(ss, type);
 
     // bad # args?
-    if (type.length() != 1) {
+    if (type.empty()) {
       respond_with_code(501);
       return false;
     }
 
-    // only handle the binary/image ("I") type for now
-    // the other types are too much work, so just return 504
+    // handle the binary/image ("I") and ASCII ("A", non-print) types;
+    // EBCDIC and the other formats are too much work, so just return 504
     if (type == "I") {
       // update session state
-      this->current_type = type[0];
+      this->current_type = 'I';
 
       respond_with("200 Switching to Binary mode.");
       return true;
+    } else if (type == "A" || type == "A N") {
+      // update session state
+      this->current_type = 'A';
+
+      respond_with("200 Switching to ASCII mode.");
+      return true;
     } else {
       respond_with_code(504);
       return false;
@@ -311,19 +388,52 @@ private:
       return false;
     }
 
-    // only handle the Stream ("S") mode for now
+    // handle the Stream ("S") mode, and Deflate ("Z", which compresses
+    // each transfer as one zlib stream); Block and Compressed are obsolete
     if (mode == "S") {
       // update session state
       this->current_mode = mode[0];
 
       respond_with("200 Switching to Stream mode.");
       return true;
+    } else if (mode == "Z") {
+      // update session state
+      this->current_mode = mode[0];
+
+      respond_with("200 Switching to Deflate mode.");
+      return true;
     } else {
       respond_with_code(504);
       return false;
     }
   }
 
+  // set options for a command; only "OPTS MODE Z LEVEL <0-9>" for now
+  bool OPTS(std::string const& cmd, std::stringstream& ss) {
+    std::string command, mode, option, junk;
+    int level = -1;
+    ss >> command >> mode >> option >> level;
+
+    // bad # args?
+    if (command.empty() || (ss >> junk)) {
+      respond_with_code(501);
+      return false;
+    }
+
+    if (command != "MODE" || mode != "Z" || option != "LEVEL" || level < 0 || level > 9) {
+      respond_with_code(501);
+      return false;
+    }
+
+    // update session state
+    this->z_level = level;
+
+    std::stringstream msg;
+    msg << "200 MODE Z LEVEL set to " << level << ".";
+    respond_with(msg.str());
+    return true;
+  }
+
   // change transfer structure
   bool STRU(std::string const& cmd, std::stringstream& ss) {
     std::string stru;
@@ -391,14 +501,10 @@ private:
       return false;
     }
 
-    if (this->_mkdir(path)) {
-      std::string new_path;
-      if (path[0] == '/') {
-	new_path = this->_get_abspath(this->real_root+path);
-      } else {
-	new_path = this->_get_abspath(path);
-      }
-      respond_with(std::string("257 \"") + fakify(new_path) + "\" directory created");
+    std::string new_path;
+
+    if (this->_mkdir(path, new_path)) {
+      respond_with(std::string("257 \"") + this->paths.fakify(new_path) + "\" directory created");
       return true;
     } else {
       respond_with_code(550);
@@ -475,13 +581,26 @@ private:
     this->data_si.sin_port = htons(this->data_port);
 
     if (connect(this->data_fd, (sockaddr*)&this->data_si,
-		sizeof(this->data_si)) == 0) {
-      // update session state
-      this->data_connected = true;
-      return true;
-    } else {
+		sizeof(this->data_si)) != 0) {
+      close(this->data_fd);
+      this->data_fd = -1;
+      return false;
+    }
+
+    this->data.reset(this->data_fd);
+    this->tuner.begin(this->data_fd);
+
+    // PROT P: we are the TLS server on the data connection too
+    if (this->prot_private && !this->data.start_tls(*this->tls)) {
+      this->tuner.finish();
+      close(this->data_fd);
+      this->data_fd = -1;
       return false;
     }
+
+    // update session state
+    this->data_connected = true;
+    return true;
   }
 
   // helper method: close a data connection
@@ -496,6 +615,12 @@ private:
       this->data_connected = false;
       return true;
     } else {
+      this->data.reset(-1);
+
+      TransferTuner::Result res_tcp = this->tuner.finish();
+      this->stats->count_transfer(res_tcp.usec, res_tcp.bytes, res_tcp.rtt_usec,
+				  res_tcp.retrans);
+
       int res = close(this->data_fd);
       // update session state
       this->data_fd = -1;
@@ -515,12 +640,33 @@ private:
       return false;
     }
 
-    // require Image type for this operation
-    if (this->current_type != 'I') {
-      respond_with_code(451);
+    // the dir we want to list
+    std::string dir;
+
+    if (!this->paths.resolve_dir(this->cwd, dir)) {
+      respond_with_code(450);
       return false;
     }
 
+    // only pass options through to `ls`
+    if (opt.empty() || opt[0] != '-') {
+      opt.clear();
+    }
+
+    // the listing, from the cache if nothing changed since last time
+    std::string listing;
+
+    if (!this->listings.get(dir, opt, listing)) {
+      unsigned long epoch = this->listings.begin(dir);
+
+      if (!this->_run_ls(dir, opt, listing)) {
+	respond_with_code(450);
+	return false;
+      }
+
+      this->listings.put(dir, opt, listing, epoch);
+    }
+
     // begin data connection
     respond_with_code(150);
 
@@ -529,32 +675,87 @@ private:
       return false;
     }
 
+    if (this->current_type == 'A') {
+      std::string encoded(2 * listing.size(), '\0');
+      encoded.resize(Ascii::encode(listing.data(), listing.size(), &encoded[0]));
+      listing.swap(encoded);
+    }
+
+    Stats::Slot::add(this->stats->bytes_out, listing.size());
+
+    if (this->current_mode == 'Z') {
+      std::string compressed;
+
+      if (!ParallelDeflate::compress(listing, this->z_level, compressed)) {
+	this->_data_disconnect();
+	respond_with_code(451);
+	return false;
+      }
+
+      listing.swap(compressed);
+      Stats::Slot::add(this->stats->z_bytes_out, listing.size());
+    }
+
+    this->data.send_all(listing.data(), listing.size());
+
+    // end data connection
+    respond_with_code(226);
+    this->_data_disconnect();
+    return true;
+  }
+
+  // helper method: run `ls` in `dir` and collect its output
+  bool _run_ls(std::string const& dir, std::string const& opt, std::string& out) const {
+    int pfd[2];
+
+    if (pipe(pfd) == -1) {
+      return false;
+    }
+
     int pid = fork();
 
+    if (pid == -1) {
+      close(pfd[0]);
+      close(pfd[1]);
+      return false;
+    }
+
     if (pid == 0) {
       // child process: run `ls`
-      dup2(this->data_fd, 1);
+      dup2(pfd[1], 1);
+      close(pfd[0]);
+      close(pfd[1]);
 
-      if (!opt.empty() && opt[0] == '-') {
+      if (chdir(dir.c_str()) == -1) {
+	_exit(1);
+      }
+
+      if (!opt.empty()) {
 	execl("/bin/ls", "ls", opt.c_str(), NULL);
       }	else {
 	execl("/bin/ls", "ls", NULL);
       }
 
-      // dead code
-      return true;
-    } else {
-      // parent process: wait for `ls` to complete
-      ::wait(NULL);
+      _exit(1);
     }
 
-    // end data connection
-    respond_with_code(226);
-    this->_data_disconnect();
-    return true;
+    // parent process: read until `ls` closes its end, then reap it
+    close(pfd[1]);
+    char buf[4096];
+    ssize_t len;
+
+    while ((len = read(pfd[0], buf, sizeof(buf))) > 0) {
+      out.append(buf, len);
+    }
+
+    close(pfd[0]);
+
+    int status;
+    ::waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
   }
 
-  // copy file to server via `cat` executable
+  // copy file to server
   bool STOR(std::string const& cmd, std::stringstream& ss) {
     std::string filename;
     std::getline(ss, filename);
@@ -571,10 +772,26 @@ private:
       return false;
     }
 
-    // require Image type for this operation
-    if (this->current_type != 'I') {
-      respond_with_code(451);
-      return false;
+    // the file we want to write on the server (never through a symlink)
+    std::string real;
+
+    // one range of a segmented upload?
+    if (this->seg_pending) {
+      this->seg_pending = false;
+
+      // byte offsets mean nothing once line endings get rewritten or the
+      // data is compressed, and the dedup store only takes whole files
+      if (this->current_type != 'I' || this->current_mode != 'S' || this->dedup != nullptr) {
+	respond_with_code(504);
+	return false;
+      }
+
+      if (!this->_get_newpath(filename, real)) {
+	respond_with_code(450);
+	return false;
+      }
+
+      return this->_stor_segment(real);
     }
 
     // begin data connection
@@ -585,42 +802,184 @@ private:
       return false;
     }
 
-    // the file we want to write on the server
-    int fdout = creat(filename.c_str(), 0644);
+    // with a dedup store, the file becomes a manifest of stored chunks
+    // (and what it replaced may have left some chunks unused)
+    if (this->dedup != nullptr) {
+      bool ok = this->_stor_dedup(filename);
+      this->dedup->collect(false);
+      return ok;
+    }
+
+    int fdout = -1;
+
+    if (this->_get_newpath(filename, real)) {
+      fdout = this->paths.open(real, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
 
     if (fdout == -1) {
+      this->_data_disconnect();
       respond_with_code(450);
       return false;
     }
 
-    int pid = fork();
+    bool ok;
+    uint64_t received = this->_receive_file(this->data, [&](char const* buf, size_t len) {
+	return this->_write_all(fdout, buf, len);
+      }, ok);
+    Stats::Slot::add(this->stats->bytes_in, received);
+    close(fdout);
 
-    if (pid == 0) {
-      // child process: run `cat` to copy data from client data socket -> server file
-      dup2(this->data_fd, 0);
-      dup2(fdout, 1);
-      execl("/bin/cat", "cat", NULL);
+    // end data connection
+    this->_data_disconnect();
 
-      // dead code
-      return true;
-    } else {
-      // parent process: wait for child to finish the STOR heavy-lifting
-      ::wait(NULL);
+    if (!ok) {
+      respond_with_code(451);
+      return false;
     }
 
-    // end data connection
     respond_with_code(226);
+    return true;
+  }
+
+  // helper method: write an upload into the dedup store; `filename` is
+  // replaced by the manifest only once every chunk is safely stored
+  bool _stor_dedup(std::string const& filename) {
+    std::string real;
+    struct stat st;
+
+    // never replace a directory (or anything else) with a manifest
+    if (!this->_get_newpath(filename, real) ||
+	(lstat(real.c_str(), &st) == 0 && !S_ISREG(st.st_mode))) {
+      this->_data_disconnect();
+      respond_with_code(450);
+      return false;
+    }
+
+    DedupStore::Writer writer(*this->dedup);
+    bool ok;
+    uint64_t received = this->_receive_file(this->data, [&](char const* buf, size_t len) {
+	return writer.write(buf, len);
+      }, ok);
+    Stats::Slot::add(this->stats->bytes_in, received);
+
+    // end data connection
     this->_data_disconnect();
+
+    if (!ok || !writer.commit(real)) {
+      respond_with_code(451);
+      return false;
+    }
+
+    Stats::Slot::add(this->stats->dedup_stored, writer.bytes_stored());
+    Stats::Slot::add(this->stats->dedup_duplicate, writer.bytes_duplicate());
+    respond_with_code(226);
     return true;
   }
 
-  // get file from server via `cat` executable
-  bool RETR(std::string const& cmd, std::stringstream& ss) {
-    std::string filename;
-    std::getline(ss, filename);
+  // helper method: copy everything from the data connection into `sink`,
+  // inflating it in MODE Z and turning CRLFs into LFs for ASCII type;
+  // returns bytes received (after inflating)
+  uint64_t _receive_file(Channel const& in,
+			 std::function<bool(char const*, size_t)> const& sink,
+			 bool& ok) const {
+    bool ascii = (this->current_type == 'A');
+    std::vector<char> buf(256 * 1024);
+    std::vector<char> decoded(ascii ? buf.size() + 1 : 0);
+    bool pending_cr = false;
+    uint64_t received = 0;
+    ok = true;
+
+    // the data as it was before it went on the wire (the inflater hands
+    // it over at most `buf.size()` bytes at a time, too)
+    auto deliver = [&](char const* data, size_t len) {
+      received += len;
+
+      if (ascii) {
+	len = Ascii::decode(data, len, decoded.data(), pending_cr);
+	data = decoded.data();
+      }
+
+      return sink(data, len);
+    };
+
+    std::unique_ptr<Inflater> inflater;
+
+    if (this->current_mode == 'Z') {
+      inflater.reset(new Inflater(deliver));
+    }
+
+    for (;;)
+    {
+      ssize_t cnt = in.recv(buf.data(), buf.size());
+
+      if (cnt <= 0) {
+	ok = (cnt == 0);
+	break;
+      }
+
+      bool delivered;
+
+      if (inflater) {
+	Stats::Slot::add(this->stats->z_bytes_in, cnt);
+	delivered = inflater->feed(buf.data(), cnt);
+      } else {
+	delivered = deliver(buf.data(), cnt);
+      }
+
+      if (!delivered) {
+	ok = false;
+	return received;
+      }
+    }
+
+    // a compressed upload that stops short of its end is truncated
+    if (inflater && !inflater->finished()) {
+      ok = false;
+    }
+
+    if (ascii) {
+      size_t len = Ascii::finish(decoded.data(), pending_cr);
+      ok = ok && sink(decoded.data(), len);
+    }
+
+    return received;
+  }
+
+  // helper method: write a whole buffer to a file
+  bool _write_all(int fd, char const* buf, size_t len) const {
+    while (len > 0) {
+      ssize_t cnt = write(fd, buf, len);
+
+      if (cnt == -1) {
+	if (errno == EINTR) {
+	  continue;
+	}
+
+	return false;
+      }
+
+      buf += cnt;
+      len -= cnt;
+    }
+
+    return true;
+  }
+
+  // announce that the next STOR only carries bytes [offset, offset+length)
+  // of a file that is `total` bytes long (non-standard: "SEGM offset length
+  // total [id]"); the other ranges may arrive over sibling sessions, which
+  // have to give the same `id` (by default, they have to come from the
+  // same address)
+  bool SEGM(std::string const& cmd, std::stringstream& ss) {
+    uint64_t offset, length, total;
+    std::string id, junk;
+    ss >> offset >> length >> total;
+    bool bad = ss.fail();
+    ss >> id;
 
     // bad # args?
-    if (filename.empty()) {
+    if (bad || (ss >> junk) || id.size() > 64 ||
+	!SegmentedUpload::valid_range(offset, length, total)) {
       respond_with_code(501);
       return false;
     }
@@ -631,9 +990,25 @@ private:
       return false;
     }
 
-    // require Image type for this operation
-    if (this->current_type != 'I') {
-      respond_with_code(451);
+    // update session state
+    this->seg_offset = offset;
+    this->seg_length = length;
+    this->seg_total = total;
+    this->seg_owner = (id.empty() ? std::string("addr ") + inet_ntoa(this->sender.sin_addr) :
+		       "id " + id);
+    this->seg_pending = true;
+
+    respond_with_code(200);
+    return true;
+  }
+
+  // helper method: receive one range of a segmented upload into `real`
+  bool _stor_segment(std::string const& real) {
+    SegmentedUpload upload(real, this->seg_owner, this->seg_offset, this->seg_length,
+			   this->seg_total);
+
+    if (!upload.open()) {
+      respond_with_code(450);
       return false;
     }
 
@@ -645,169 +1020,412 @@ private:
       return false;
     }
 
+    uint64_t received = upload.receive(this->data);
+    Stats::Slot::add(this->stats->bytes_in, received);
+    this->_data_disconnect();
+
+    bool committed;
+
+    if (received != this->seg_length || !upload.finish(committed)) {
+      respond_with_code(451);
+      return false;
+    }
+
+    // end data connection
+    if (committed) {
+      respond_with_code(226);
+    } else {
+      respond_with("226 Segment stored; waiting for the other segments.");
+    }
+
+    return true;
+  }
+
+  // switch the control connection to TLS (RFC 4217)
+  bool AUTH(std::string const& cmd, std::stringstream& ss) {
+    std::string mechanism;
+    std::getline(ss, mechanism);
+
+    // bad # args?
+    if (mechanism.empty()) {
+      respond_with_code(501);
+      return false;
+    }
+
+    // no certificate configured?
+    if (this->tls == nullptr) {
+      respond_with_code(502);
+      return false;
+    }
+
+    if (mechanism != "TLS" && mechanism != "TLS-C" && mechanism != "SSL") {
+      respond_with_code(504);
+      return false;
+    }
+
+    // already secure?
+    if (this->ctrl.secure()) {
+      respond_with_code(503);
+      return false;
+    }
+
+    respond_with("234 Proceed with negotiation.");
+
+    // a failed handshake leaves the connection in an unknown state
+    if (!this->ctrl.start_tls(*this->tls)) {
+      this->running = false;
+      return false;
+    }
+
+    return true;
+  }
+
+  // protection buffer size; meaningless for TLS, so it's always 0
+  bool PBSZ(std::string const& cmd, std::stringstream& ss) {
+    std::string size;
+    std::getline(ss, size);
+
+    // bad # args?
+    if (size.empty() || size.find_first_not_of("0123456789") != std::string::npos) {
+      respond_with_code(501);
+      return false;
+    }
+
+    // has to follow AUTH
+    if (!this->ctrl.secure()) {
+      respond_with_code(503);
+      return false;
+    }
+
+    // update session state
+    this->pbsz_set = true;
+
+    respond_with("200 PBSZ=0");
+    return true;
+  }
+
+  // data channel protection level
+  bool PROT(std::string const& cmd, std::stringstream& ss) {
+    std::string level;
+    std::getline(ss, level);
+
+    // bad # args?
+    if (level.length() != 1) {
+      respond_with_code(501);
+      return false;
+    }
+
+    // has to follow PBSZ
+    if (!this->pbsz_set) {
+      respond_with_code(503);
+      return false;
+    }
+
+    // only handle Clear ("C") and Private ("P")
+    if (level == "C" || level == "P") {
+      // update session state
+      this->prot_private = (level == "P");
+      this->_data_disconnect();
+
+      respond_with_code(200);
+      return true;
+    } else {
+      respond_with("536 Requested PROT level not supported by mechanism.");
+      return false;
+    }
+  }
+
+  // send file to client, straight from the page cache if it's there
+  bool RETR(std::string const& cmd, std::stringstream& ss) {
+    std::string filename;
+    std::getline(ss, filename);
+
+    // bad # args?
+    if (filename.empty()) {
+      respond_with_code(501);
+      return false;
+    }
+
+    // authorized?
+    if (!this->logged_in) {
+      respond_with_code(530);
+      return false;
+    }
+
     // the file we want to read from the server
-    int fdin = open(filename.c_str(), O_RDONLY);
+    std::string real;
+    int fdin = -1;
+
+    if (this->_get_realpath(filename, real)) {
+      fdin = this->paths.open(real, O_RDONLY);
+    }
+
+    struct stat st;
+
+    if (fdin == -1 || fstat(fdin, &st) == -1 || !S_ISREG(st.st_mode)) {
+      if (fdin != -1) {
+	close(fdin);
+      }
 
-    if (fdin == -1) {
       respond_with_code(450);
       return false;
     }
 
-    int pid = fork();
+    // a file uploaded into the dedup store is only a list of chunks, which
+    // have to stay put until they're sent
+    DedupStore::Manifest manifest;
+    std::unique_ptr<DedupStore::Hold> hold;
 
-    if (pid == 0) {
-      // child process: run `cat` to copy data from server file -> client data socket
-      dup2(fdin, 0);
-      dup2(this->data_fd, 1);
-      execl("/bin/cat", "cat", NULL);
+    if (this->dedup != nullptr) {
+      hold.reset(new DedupStore::Hold(*this->dedup));
+    }
 
-      // dead code
-      return true;
+    bool chunked = (this->dedup != nullptr && this->dedup->load(fdin, manifest));
+
+    // begin data connection
+    respond_with_code(150);
+
+    if (!this->_data_connect()) {
+      close(fdin);
+      respond_with_code(451);
+      return false;
+    }
+
+    uint64_t size = (chunked ? manifest.size : st.st_size);
+    uint64_t sent = 0;
+    bool ok;
+
+    if (this->current_mode == 'Z') {
+      ok = this->_send_deflated(fdin, st, chunked ? &manifest : nullptr, size, sent);
+    } else if (chunked) {
+      sent = this->dedup->send(manifest, this->data, this->current_type == 'A');
+      ok = (sent == size);
     } else {
-      // parent process: wait for child to finish the STOR heavy-lifting
-      ::wait(NULL);
+      sent = this->_send_file(fdin, size, this->current_type == 'A');
+      ok = (sent == size);
     }
 
+    close(fdin);
+    Stats::Slot::add(this->stats->bytes_out, sent);
+
     // end data connection
-    respond_with_code(226);
     this->_data_disconnect();
+
+    if (!ok) {
+      respond_with_code(451);
+      return false;
+    }
+
+    respond_with_code(226);
     return true;
   }
 
-  // wrapper method
-  std::string _get_cwd() const {
-    char tmp[PATH_MAX + 1] { };
-    getcwd(tmp, PATH_MAX + 1);
-    return tmp;
-  }
+  // helper method: send `size` bytes of `fd`, straight from the page cache
+  // if it's there; returns bytes sent
+  uint64_t _send_file(int fd, uint64_t size, bool ascii) {
+    // ASCII type always goes through the pipeline, which converts LFs, and
+    // so does TLS when the kernel can't do the encryption for us (dedup
+    // chunks are sent one after another, the same way)
+    if (!ascii && this->data.zero_copy() &&
+	ReadAhead::resident(fd, size, this->config.readahead_window)) {
+      return this->data.sendfile(fd, size);
+    }
 
-  bool begins_with(std::string const& input, std::string const& match) const {
-    return input.size() >= match.size() &&
-      std::equal(match.begin(), match.end(), input.begin());
+    ReadAhead pipeline(fd, size, this->config.readahead_window, ascii);
+    return pipeline.send_to(this->data);
   }
 
-  // "fakify" a path (long path -> short path)
-  std::string fakify(std::string const& path) const {
-    if (path.empty()) {
-      return "/";
+  // helper method: send a file as one zlib stream (MODE Z), compressed on
+  // the pool while earlier blocks go out, or as is from the cache if it has
+  // this version of the file; `sent` is set to the file bytes that went out
+  bool _send_deflated(int fdin, struct stat const& st, DedupStore::Manifest const* manifest,
+		      uint64_t size, uint64_t& sent) {
+    bool ascii = (this->current_type == 'A');
+    std::string key, tmp;
+    int cfd = -1;
+
+    if (this->zcache != nullptr && size >= CompressCache::min_size) {
+      key = this->zcache->key(st, this->z_level, ascii);
+      uint64_t len = 0;
+      int hit = this->zcache->lookup(key, len);
+
+      if (hit != -1) {
+	uint64_t out = this->_send_file(hit, len, false);
+	close(hit);
+	Stats::Slot::add(this->stats->z_cache_hits, 1);
+	Stats::Slot::add(this->stats->z_bytes_out, out);
+	sent = (out == len ? size : 0);
+	return out == len;
+      }
+
+      // compress it once, for everyone after us
+      cfd = this->zcache->create(tmp);
     }
 
-    if (path == this->real_root) {
-      return "/";
+    // the file, or the chunks it is made of
+    std::unique_ptr<DedupStore::Reader> chunks;
+    off_t pos = 0;
+
+    if (manifest != nullptr) {
+      chunks.reset(new DedupStore::Reader(*this->dedup, *manifest));
+    } else {
+      posix_fadvise(fdin, 0, 0, POSIX_FADV_SEQUENTIAL);
     }
 
-    if (!this->begins_with(path, this->real_root)) {
-      return "/";
+    auto source = [&](char* buf, size_t len) -> ssize_t {
+      if (chunks) {
+	return chunks->read(buf, len);
+      }
+
+      // (only what the file held when we opened it)
+      ssize_t cnt = pread(fdin, buf, std::min<uint64_t>(len, size - pos), pos);
+      pos += (cnt > 0 ? cnt : 0);
+      return cnt;
+    };
+
+    // a failed cache write only costs the cache entry
+    uint64_t wire = 0;
+
+    auto sink = [&](char const* buf, size_t len) {
+      if (cfd != -1 && !this->_write_all(cfd, buf, len)) {
+	close(cfd);
+	this->zcache->abort(tmp);
+	cfd = -1;
+      }
+
+      wire += len;
+      return this->data.send_all(buf, len);
+    };
+
+    ParallelDeflate deflater(*this->pool, this->z_level, ascii);
+    bool ok;
+    sent = deflater.run(source, sink, ok);
+    ok = ok && sent == size;
+    Stats::Slot::add(this->stats->z_bytes_out, wire);
+
+    if (cfd != -1) {
+      if (close(cfd) == 0 && ok) {
+	this->zcache->commit(tmp, key);
+      } else {
+	this->zcache->abort(tmp);
+      }
     }
 
-    return path.substr(this->real_root.length(), std::string::npos);
+    return ok;
   }
 
-  // wrapper method, with sandboxing
-  bool _set_cwd(std::string const& path) {
+  // map a client path to a real path inside the sandbox
+  bool _get_realpath(std::string const& path, std::string& real) {
     if (path.empty()) {
       return false;
     }
 
-    std::string old_cwd(this->_get_cwd());
-
-    if (chdir(path.c_str()) == 0) {
-      std::string new_cwd(this->_get_cwd());
+    return this->paths.resolve(PathResolver::normalize(this->cwd, path), real);
+  }
 
-      // check if the new directory is outside our namespace:
-      // does the new cwd start with the root dir? if not, go back
-      if (this->begins_with(new_cwd, this->real_root)) {
-	return true;
-      } else {
-	chdir(old_cwd.c_str());
-	return false;
-      }
-    } else {
+  // map a client path to a real path whose parent dir is inside the sandbox
+  bool _get_newpath(std::string const& path, std::string& real) {
+    if (path.empty()) {
       return false;
     }
+
+    return this->paths.resolve_parent(PathResolver::normalize(this->cwd, path), real);
   }
 
-  // wrapper method
-  bool _rmdir(std::string const& path) const {
+  // change the virtual cwd, with sandboxing
+  bool _set_cwd(std::string const& path) {
     if (path.empty()) {
       return false;
     }
 
-    // handle absolute paths
-    if (path[0] == '/') {
-      std::string new_path = this->real_root + path;
-      return rmdir(path.c_str()) == 0;
-    } else {
-      std::string abs_path = this->_get_abspath(path);
+    std::string real;
 
-      // only delete things inside the namespace
-      if (this->begins_with(abs_path, this->real_root)) {
-	return rmdir(path.c_str()) == 0;
-      } else {
-	return false;
-      }
+    if (!this->paths.resolve_dir(PathResolver::normalize(this->cwd, path), real)) {
+      return false;
     }
+
+    // update session state
+    this->cwd = this->paths.fakify(real);
+    return true;
   }
 
-  // wrapper method
-  bool _mkdir(std::string const& path) const {
-    if (path.empty()) {
+  // wrapper method, with sandboxing
+  bool _rmdir(std::string const& path) {
+    std::string real;
+
+    if (!this->_get_newpath(path, real)) {
       return false;
     }
 
-    // handle absolute paths
-    if (path[0] == '/') {
-      std::string new_path = this->real_root + path;
-      return mkdir(new_path.c_str(), S_IRWXU) == 0;
+    if (rmdir(real.c_str()) == 0) {
+      this->paths.invalidate(real);
+      return true;
     } else {
-      std::string abs_path = this->_get_abspath(path);
-
-      // only create things inside the namespace
-      if (this->begins_with(abs_path, this->real_root)) {
-	return mkdir(path.c_str(), S_IRWXU) == 0;
-      } else {
-	return false;
-      }
+      return false;
     }
   }
 
-  // wrapper method
-  std::string _get_abspath(std::string const& path) const {
-    if (path.empty()) {
-      return std::string();
+  // wrapper method, with sandboxing
+  bool _mkdir(std::string const& path, std::string& real) {
+    if (!this->_get_newpath(path, real)) {
+      return false;
     }
 
-    char tmp[PATH_MAX + 1] { };
-    realpath(path.c_str(), tmp);
-    return tmp;
+    return mkdir(real.c_str(), S_IRWXU) == 0;
   }
 
   // the only constructor
-  explicit Session(int fd_, sockaddr_in& sender_) :
-    fd(fd_), sender(sender_), running(true), current_type('A'),
-    current_mode('S'), current_structure('F'), logged_in(false),
-    data_connected(false), data_port(0), data_fd(-1),
-    real_root(_get_abspath(".")) {
+  explicit Session(int fd_, sockaddr_in& sender_, SessionContext const& ctx) :
+    fd(fd_), sender(sender_), ctrl(fd_), config(*ctx.config), tls(ctx.tls),
+    stats(ctx.stats), trace(ctx.trace), dedup(ctx.dedup), pool(ctx.pool),
+    zcache(ctx.zcache), running(true), current_type('A'),
+    current_mode('S'), current_structure('F'), z_level(6),
+    logged_in(false),
+    data_connected(false), data_port(0), data_fd(-1), seg_pending(false),
+    seg_offset(0), seg_length(0), seg_total(0), pbsz_set(false),
+    prot_private(false),
+    watcher(*ctx.watcher), paths(*ctx.paths), listings(*ctx.listings), cwd("/") {
+    this->data.set_tuner(&this->tuner);
+
+    if (this->trace != nullptr) {
+      this->trace_id = this->trace->new_session();
+      this->trace->record(this->trace_id, Trace::now(), 0, "+");
+    }
   }
 
   // clean up resources
   virtual ~Session() {
+    if (this->trace != nullptr) {
+      this->trace->record(this->trace_id, Trace::now(), 0, "-");
+    }
+
+    this->ctrl.end_tls();
+
     if (this->fd != -1) {
       close(this->fd);
     }
 
     this->_data_disconnect();
-    this->_set_cwd(this->real_root);
   }
 
   int fd;
   sockaddr_in sender;
+  Channel ctrl;
+  Config const& config;
+  TlsContext const* tls;
+  Stats::Slot* stats;
+  Trace* trace;
+  std::string trace_id;
+  DedupStore const* dedup;
+  ThreadPool* pool;
+  CompressCache const* zcache;
 
   bool running;
 
   char current_type;
   char current_mode;
   char current_structure;
+  int z_level;
   bool logged_in;
   std::string current_user;
 
@@ -816,8 +1434,22 @@ private:
   int data_port;
   int data_fd;
   sockaddr_in data_si;
-
-  std::string real_root;
+  Channel data;
+  TransferTuner tuner;
+
+  bool seg_pending;
+  uint64_t seg_offset;
+  uint64_t seg_length;
+  uint64_t seg_total;
+  std::string seg_owner;
+
+  bool pbsz_set;
+  bool prot_private;
+
+  Watcher& watcher;
+  PathResolver& paths;
+  ListingCache& listings;
+  std::string cwd;
 };
 
 #endif
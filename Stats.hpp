@@ -0,0 +1,179 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Stats.hpp: server counters, shared between worker processes
+*/
+#ifndef STATS_HPP
+#define STATS_HPP 1
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <new>
+#include <sys/mman.h>
+
+// per-process counters living in a shared memory segment: each worker
+// only ever writes its own slot, so the master can sum them without locks
+class Stats {
+public:
+  enum Command {
+    CMD_QUIT, CMD_USER, CMD_SYST, CMD_PWD, CMD_CWD, CMD_TYPE, CMD_MODE,
+    CMD_STRU, CMD_RMD, CMD_MKD, CMD_PORT, CMD_LIST, CMD_STOR, CMD_RETR,
+    CMD_SEGM, CMD_AUTH, CMD_PBSZ, CMD_PROT, CMD_OPTS, CMD_OTHER, CMD_COUNT
+  };
+
+  // one worker's counters (a cache line apart from its neighbours)
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> sessions;
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> commands[CMD_COUNT];
+    // data connections, and what TCP_INFO said when they closed
+    std::atomic<uint64_t> transfers;
+    std::atomic<uint64_t> transfer_usec;
+    std::atomic<uint64_t> transfer_bytes;
+    std::atomic<uint64_t> rtt_usec;
+    std::atomic<uint64_t> retrans;
+    // uploads to the dedup store: bytes written as new chunks, and bytes
+    // that were already there
+    std::atomic<uint64_t> dedup_stored;
+    std::atomic<uint64_t> dedup_duplicate;
+    // MODE Z: compressed bytes on the wire, and RETRs served from the cache
+    std::atomic<uint64_t> z_bytes_in;
+    std::atomic<uint64_t> z_bytes_out;
+    std::atomic<uint64_t> z_cache_hits;
+
+    Slot() : sessions(0), bytes_in(0), bytes_out(0), transfers(0),
+      transfer_usec(0), transfer_bytes(0), rtt_usec(0), retrans(0),
+      dedup_stored(0), dedup_duplicate(0),
+      z_bytes_in(0), z_bytes_out(0), z_cache_hits(0) {
+      for (auto& c : this->commands) {
+	c.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    // single writer, so a plain load/store pair is enough
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+      counter.store(counter.load(std::memory_order_relaxed) + n,
+		    std::memory_order_relaxed);
+    }
+
+    void count_command(std::string const& cmd) {
+      add(this->commands[command_index(cmd)], 1);
+    }
+
+    void count_transfer(uint64_t usec, uint64_t bytes, uint32_t rtt, uint32_t lost) {
+      add(this->transfers, 1);
+      add(this->transfer_usec, usec);
+      add(this->transfer_bytes, bytes);
+      add(this->rtt_usec, rtt);
+      add(this->retrans, lost);
+    }
+  };
+
+  // map `nslots` zeroed slots, shared with any children forked afterwards
+  explicit Stats(size_t nslots_) : slots(nullptr), nslots(nslots_) {
+    void* mem = mmap(nullptr, sizeof(Slot) * this->nslots, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+      this->nslots = 0;
+      return;
+    }
+
+    this->slots = static_cast<Slot*>(mem);
+
+    for (size_t i = 0; i < this->nslots; i++) {
+      new (&this->slots[i]) Slot();
+    }
+  }
+
+  bool valid() const {
+    return this->slots != nullptr;
+  }
+
+  Slot* slot(size_t i) const {
+    return (i < this->nslots ? &this->slots[i] : nullptr);
+  }
+
+  // sum every slot into a single line of "name=value" pairs
+  std::string summary() const {
+    uint64_t sessions = 0, bytes_in = 0, bytes_out = 0;
+    uint64_t transfers = 0, usec = 0, bytes = 0, rtt = 0, retrans = 0;
+    uint64_t stored = 0, duplicate = 0, z_in = 0, z_out = 0, z_hits = 0;
+    uint64_t commands[CMD_COUNT] { };
+
+    for (size_t i = 0; i < this->nslots; i++) {
+      Slot const& s = this->slots[i];
+      sessions += s.sessions.load(std::memory_order_relaxed);
+      bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+      bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+      transfers += s.transfers.load(std::memory_order_relaxed);
+      usec += s.transfer_usec.load(std::memory_order_relaxed);
+      bytes += s.transfer_bytes.load(std::memory_order_relaxed);
+      rtt += s.rtt_usec.load(std::memory_order_relaxed);
+      retrans += s.retrans.load(std::memory_order_relaxed);
+      stored += s.dedup_stored.load(std::memory_order_relaxed);
+      duplicate += s.dedup_duplicate.load(std::memory_order_relaxed);
+      z_in += s.z_bytes_in.load(std::memory_order_relaxed);
+      z_out += s.z_bytes_out.load(std::memory_order_relaxed);
+      z_hits += s.z_cache_hits.load(std::memory_order_relaxed);
+
+      for (int c = 0; c < CMD_COUNT; c++) {
+	commands[c] += s.commands[c].load(std::memory_order_relaxed);
+      }
+    }
+
+    std::stringstream ss;
+    ss << "sessions=" << sessions << " bytes_in=" << bytes_in
+       << " bytes_out=" << bytes_out << " transfers=" << transfers
+       << " avg_rtt_usec=" << (transfers ? rtt / transfers : 0)
+       << " retrans=" << retrans
+       << " bytes_per_sec=" << (usec ? bytes * 1000000 / usec : 0)
+       << " dedup_stored=" << stored << " dedup_duplicate=" << duplicate
+       << " z_bytes_in=" << z_in << " z_bytes_out=" << z_out << " z_cache_hits=" << z_hits;
+
+    for (int c = 0; c < CMD_COUNT; c++) {
+      ss << ' ' << command_name(c) << '=' << commands[c];
+    }
+
+    return ss.str();
+  }
+
+  static char const* command_name(int c) {
+    static char const* const names[CMD_COUNT] = {
+      "QUIT", "USER", "SYST", "PWD", "CWD", "TYPE", "MODE",
+      "STRU", "RMD", "MKD", "PORT", "LIST", "STOR", "RETR",
+      "SEGM", "AUTH", "PBSZ", "PROT", "OPTS", "OTHER"
+    };
+
+    return names[c];
+  }
+
+  static int command_index(std::string const& cmd) {
+    for (int c = 0; c < CMD_OTHER; c++) {
+      if (cmd == command_name(c)) {
+	return c;
+      }
+    }
+
+    return CMD_OTHER;
+  }
+
+  // cleanup
+  virtual ~Stats() {
+    if (this->slots != nullptr) {
+      munmap(this->slots, sizeof(Slot) * this->nslots);
+    }
+  }
+
+private:
+  Stats(Stats const&) = delete;
+  Stats& operator=(Stats const&) = delete;
+
+  Slot* slots;
+  size_t nslots;
+};
+
+#endif
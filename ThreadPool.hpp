@@ -0,0 +1,85 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+ThreadPool.hpp: class for running jobs on a fixed set of threads
+*/
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP 1
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+// a few threads taking jobs off a FIFO queue; create it after fork(), since
+// threads don't survive into the child
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned nthreads) : stop(false) {
+    for (unsigned i = 0; i < (nthreads ? nthreads : 1); i++) {
+      this->threads.push_back(std::thread(&ThreadPool::_run, this));
+    }
+  }
+
+  // queue `job` to run on some pool thread
+  void submit(std::function<void()> const& job) {
+    {
+      std::lock_guard<std::mutex> lock(this->mtx);
+      this->jobs.push_back(job);
+    }
+
+    this->cv.notify_one();
+  }
+
+  size_t size() const {
+    return this->threads.size();
+  }
+
+  // finish the queued jobs, then stop the threads
+  virtual ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(this->mtx);
+      this->stop = true;
+    }
+
+    this->cv.notify_all();
+
+    for (auto& t : this->threads) {
+      t.join();
+    }
+  }
+
+private:
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  void _run() {
+    for (;;) {
+      std::function<void()> job;
+
+      {
+	std::unique_lock<std::mutex> lock(this->mtx);
+	this->cv.wait(lock, [this] { return this->stop || !this->jobs.empty(); });
+
+	if (this->jobs.empty()) {
+	  return;
+	}
+
+	job.swap(this->jobs.front());
+	this->jobs.pop_front();
+      }
+
+      job();
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()> > jobs;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stop;
+};
+
+#endif
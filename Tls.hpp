@@ -0,0 +1,64 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Tls.hpp: class for the server's TLS settings
+*/
+#ifndef TLS_HPP
+#define TLS_HPP 1
+
+#include <string>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// the server's certificate and key, shared by every TLS connection;
+// kernel TLS is enabled so that OpenSSL hands the session keys to the
+// socket (TCP_ULP "tls") after the handshake whenever the kernel and
+// cipher allow it
+class TlsContext {
+public:
+  TlsContext() : ctx(nullptr) {
+  }
+
+  // load a PEM certificate (chain) and private key
+  bool load(std::string const& cert, std::string const& key) {
+    this->ctx = SSL_CTX_new(TLS_server_method());
+
+    if (this->ctx == nullptr) {
+      return false;
+    }
+
+    SSL_CTX_set_min_proto_version(this->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(this->ctx, SSL_OP_ENABLE_KTLS);
+
+    // clients resume the control connection's session on data connections
+    SSL_CTX_set_session_cache_mode(this->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(this->ctx, (unsigned char const*)"my_ftpd", 7);
+
+    return SSL_CTX_use_certificate_chain_file(this->ctx, cert.c_str()) == 1 &&
+      SSL_CTX_use_PrivateKey_file(this->ctx, key.c_str(), SSL_FILETYPE_PEM) == 1 &&
+      SSL_CTX_check_private_key(this->ctx) == 1;
+  }
+
+  bool valid() const {
+    return this->ctx != nullptr;
+  }
+
+  SSL_CTX* get() const {
+    return this->ctx;
+  }
+
+  // cleanup
+  virtual ~TlsContext() {
+    if (this->ctx != nullptr) {
+      SSL_CTX_free(this->ctx);
+    }
+  }
+
+private:
+  TlsContext(TlsContext const&) = delete;
+  TlsContext& operator=(TlsContext const&) = delete;
+
+  SSL_CTX* ctx;
+};
+
+#endif
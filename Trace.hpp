@@ -0,0 +1,84 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Trace.hpp: class for recording the command stream of every session
+*/
+#ifndef TRACE_HPP
+#define TRACE_HPP 1
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+
+// appends one line per command to a trace file that all workers share:
+//
+//   <usec> <session> <elapsed usec> <data bytes> <command line>
+//
+// <usec> is the wall-clock time the command arrived, <session> is
+// "<pid>.<n>", and <data bytes> is what moved over the data connection
+// while the command ran (file contents are never recorded); a session
+// starts with a "+" line and ends with a "-" line; see ftp_replay.cpp
+class Trace {
+public:
+  Trace() : fd(-1), sessions(0) {
+  }
+
+  // start appending to `path`
+  bool open(std::string const& path) {
+    this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    return this->fd != -1;
+  }
+
+  bool valid() const {
+    return this->fd != -1;
+  }
+
+  // a name for a new session, unique across worker processes
+  std::string new_session() {
+    std::stringstream id;
+    id << getpid() << '.' << ++this->sessions;
+    return id.str();
+  }
+
+  static uint64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // log a command that arrived at `start` and has just finished
+  void record(std::string const& session, uint64_t start, uint64_t bytes,
+	      std::string const& line) const {
+    if (this->fd == -1) {
+      return;
+    }
+
+    std::stringstream entry;
+    entry << start << ' ' << session << ' ' << (now() - start) << ' ' << bytes
+	  << ' ' << line << '\n';
+
+    // one write() per line, so O_APPEND keeps the workers' lines whole
+    std::string out = entry.str();
+    ssize_t res = write(this->fd, out.data(), out.size());
+    (void)res;
+  }
+
+  // cleanup
+  virtual ~Trace() {
+    if (this->fd != -1) {
+      close(this->fd);
+    }
+  }
+
+private:
+  Trace(Trace const&) = delete;
+  Trace& operator=(Trace const&) = delete;
+
+  int fd;
+  unsigned long sessions;
+};
+
+#endif
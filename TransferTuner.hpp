@@ -0,0 +1,150 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+TransferTuner.hpp: class for tuning a data connection from TCP_INFO
+*/
+#ifndef TRANSFERTUNER_HPP
+#define TRANSFERTUNER_HPP 1
+
+#include <cstdint>
+#include <ctime>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+// samples a data socket's TCP_INFO while the transfer runs to size the I/O
+// chunks and the unsent queue for its bandwidth-delay product and to pace
+// it when it loses packets, and reports what the connection looked like at
+// the end; the buffers themselves are left to the kernel's autotuning,
+// which setting SO_SNDBUF/SO_RCVBUF would turn off for good (and cap at
+// net.core.[wr]mem_max, well below what autotuning may grow them to)
+class TransferTuner {
+public:
+  struct Result {
+    uint64_t usec;
+    uint64_t bytes;
+    uint32_t rtt_usec;
+    uint32_t retrans;
+  };
+
+  TransferTuner() : fd(-1) {
+  }
+
+  // start tuning a freshly connected socket (the handshake gave us an RTT)
+  void begin(int fd_) {
+    this->fd = fd_;
+    this->started = _now();
+    this->last_sample = this->started;
+    this->chunk = default_chunk;
+    this->retrans = 0;
+    this->pacing = false;
+    this->_sample();
+  }
+
+  bool active() const {
+    return this->fd != -1;
+  }
+
+  // how much to move per read/write right now
+  size_t chunk_size() const {
+    return this->chunk;
+  }
+
+  // call as data moves; re-tunes at most every `sample_usec`
+  void progress() {
+    if (this->fd == -1) {
+      return;
+    }
+
+    uint64_t now = _now();
+
+    if (now - this->last_sample >= sample_usec) {
+      this->last_sample = now;
+      this->_sample();
+    }
+  }
+
+  // stop tuning and report on the transfer (call before closing the socket)
+  Result finish() {
+    Result res { };
+
+    if (this->fd == -1) {
+      return res;
+    }
+
+    tcp_info info;
+
+    if (this->_info(info)) {
+      res.bytes = info.tcpi_bytes_acked + info.tcpi_bytes_received;
+      res.rtt_usec = info.tcpi_rtt;
+      res.retrans = info.tcpi_total_retrans;
+    }
+
+    res.usec = _now() - this->started;
+    this->fd = -1;
+    return res;
+  }
+
+private:
+  static const size_t default_chunk = 256 * 1024;
+  static const size_t min_chunk = 64 * 1024;
+  static const size_t max_chunk = 4 * 1024 * 1024;
+  static const uint64_t sample_usec = 100 * 1000;
+  // what we assume the link can do until the kernel has measured it
+  static const uint64_t assumed_rate = 125 * 1000 * 1000;
+  static const int max_lowat = 64 * 1024 * 1024;
+
+  static uint64_t _now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  bool _info(tcp_info& info) const {
+    socklen_t len = sizeof(info);
+    return getsockopt(this->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0;
+  }
+
+  void _sample() {
+    tcp_info info;
+
+    if (!this->_info(info) || info.tcpi_rtt == 0) {
+      return;
+    }
+
+    // bandwidth-delay product, from the measured rate once there is one
+    uint64_t rate = (info.tcpi_delivery_rate > 0 ? info.tcpi_delivery_rate : assumed_rate);
+    uint64_t bdp = rate * info.tcpi_rtt / 1000000;
+
+    // move about a quarter of the pipe per call
+    this->chunk = std::max(size_t(min_chunk), std::min(size_t(max_chunk), size_t(bdp / 4)));
+
+    // keep about one BDP queued in the kernel, not the whole send buffer
+    int lowat = (int)std::max(uint64_t(2 * this->chunk), std::min(bdp, uint64_t(max_lowat)));
+    setsockopt(this->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+    // losing packets: pace a bit above what actually gets delivered;
+    // otherwise let the congestion control run unpaced
+    if (info.tcpi_total_retrans > this->retrans && info.tcpi_delivery_rate > 0) {
+      uint64_t pace = info.tcpi_delivery_rate + info.tcpi_delivery_rate / 4;
+      setsockopt(this->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pace, sizeof(pace));
+      this->pacing = true;
+    } else if (this->pacing) {
+      uint64_t unlimited = ~0ULL;
+      setsockopt(this->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &unlimited, sizeof(unlimited));
+      this->pacing = false;
+    }
+
+    this->retrans = info.tcpi_total_retrans;
+  }
+
+  int fd;
+  uint64_t started;
+  uint64_t last_sample;
+  size_t chunk;
+  uint32_t retrans;
+  bool pacing;
+};
+
+#endif
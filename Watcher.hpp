@@ -0,0 +1,171 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+Watcher.hpp: class for watching directories with inotify
+*/
+#ifndef WATCHER_HPP
+#define WATCHER_HPP 1
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <set>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+
+// watches directories on demand and tells subscribers when something in
+// them changes, so caches never have to expire or re-stat their entries
+class Watcher {
+public:
+  // called with the changed dir and the name of the entry inside it; an
+  // empty `name` means the dir itself went away, an empty `dir` means
+  // events were lost and everything has to be forgotten
+  typedef std::function<void(std::string const& dir, std::string const& name)> Callback;
+
+  explicit Watcher(size_t max_watches_=8192) :
+    ifd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), max_watches(max_watches_) {
+  }
+
+  bool valid() const {
+    return this->ifd != -1;
+  }
+
+  void subscribe(Callback cb) {
+    this->subscribers.push_back(cb);
+  }
+
+  // start watching a dir (if we aren't already); returns false if changes
+  // to it can't be tracked, in which case nothing about it may be cached
+  bool watch(std::string const& dir) {
+    if (this->ifd == -1) {
+      return false;
+    }
+
+    if (this->dirs.count(dir) != 0) {
+      return true;
+    }
+
+    if (this->dirs.size() >= this->max_watches) {
+      return false;
+    }
+
+    int wd = inotify_add_watch(this->ifd, dir.c_str(), events);
+
+    if (wd == -1) {
+      return false;
+    }
+
+    // the same inode may already be watched under other names; events
+    // then go out for every one of them
+    this->wds[wd].insert(dir);
+    this->dirs[dir] = wd;
+    return true;
+  }
+
+  // drain pending events without blocking and notify subscribers
+  void poll() {
+    if (this->ifd == -1) {
+      return;
+    }
+
+    alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+
+    for (;;)
+    {
+      ssize_t len = read(this->ifd, buf, sizeof(buf));
+
+      if (len <= 0) {
+	return;
+      }
+
+      for (char* p = buf; p < buf + len; ) {
+	inotify_event* ev = (inotify_event*)p;
+	p += sizeof(inotify_event) + ev->len;
+	this->_dispatch(ev);
+      }
+    }
+  }
+
+  size_t size() const {
+    return this->dirs.size();
+  }
+
+  // cleanup
+  virtual ~Watcher() {
+    if (this->ifd != -1) {
+      close(this->ifd);
+    }
+  }
+
+private:
+  Watcher(Watcher const&) = delete;
+  Watcher& operator=(Watcher const&) = delete;
+
+  static const uint32_t events = IN_CREATE | IN_DELETE | IN_MODIFY |
+    IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+  void _dispatch(inotify_event const* ev) {
+    // the kernel queue overflowed: we don't know what changed
+    if (ev->mask & IN_Q_OVERFLOW) {
+      this->_notify(std::string(), std::string());
+      return;
+    }
+
+    auto it = this->wds.find(ev->wd);
+
+    if (it == this->wds.end()) {
+      return;
+    }
+
+    // (copied: a subscriber may watch() new dirs while we notify)
+    std::set<std::string> names = it->second;
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+      // the dir itself is gone (or moved), so is its watch
+      if (!(ev->mask & IN_IGNORED)) {
+	inotify_rm_watch(this->ifd, ev->wd);
+      }
+
+      for (auto const& dir : names) {
+	this->dirs.erase(dir);
+      }
+
+      this->wds.erase(it);
+
+      for (auto const& dir : names) {
+	this->_notify(dir, std::string());
+      }
+    } else if (ev->len > 0) {
+      for (auto const& dir : names) {
+	this->_notify(dir, ev->name);
+      }
+    }
+  }
+
+  void _notify(std::string const& dir, std::string const& name) {
+    if (dir.empty()) {
+      // every watch is suspect now; start over
+      for (auto const& w : this->wds) {
+	inotify_rm_watch(this->ifd, w.first);
+      }
+
+      this->wds.clear();
+      this->dirs.clear();
+    }
+
+    for (auto const& cb : this->subscribers) {
+      cb(dir, name);
+    }
+  }
+
+  int ifd;
+  size_t max_watches;
+  std::vector<Callback> subscribers;
+  std::unordered_map<int, std::set<std::string> > wds;
+  std::unordered_map<std::string, int> dirs;
+};
+
+#endif
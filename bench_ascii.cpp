@@ -0,0 +1,76 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+bench_ascii.cpp: microbenchmark for the ASCII type end-of-line kernels
+*/
+#include <string>
+#include <vector>
+#include <random>
+#include <benchmark/benchmark.h>
+#include "Ascii.hpp"
+
+// text with lines of `line_len` printable bytes each, LF or CRLF terminated
+static std::string make_text(size_t size, size_t line_len, bool crlf) {
+  std::mt19937 rng(42);
+  std::string text;
+  text.reserve(size);
+
+  while (text.size() < size) {
+    for (size_t i = 0; i < line_len && text.size() < size; i++) {
+      text.push_back((char)(' ' + rng() % 95));
+    }
+
+    if (crlf) {
+      text.push_back('\r');
+    }
+
+    text.push_back('\n');
+  }
+
+  text.resize(size);
+  return text;
+}
+
+typedef size_t (*EncodeFn)(char const*, size_t, char*);
+typedef size_t (*DecodeFn)(char const*, size_t, char*, bool&);
+
+static void bench_encode(benchmark::State& state, EncodeFn fn) {
+  std::string text = make_text(state.range(0), state.range(1), false);
+  std::vector<char> out(2 * text.size());
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(fn(text.data(), text.size(), out.data()));
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+static void bench_decode(benchmark::State& state, DecodeFn fn) {
+  std::string text = make_text(state.range(0), state.range(1), true);
+  std::vector<char> out(text.size() + 1);
+
+  for (auto _ : state) {
+    bool pending_cr = false;
+    benchmark::DoNotOptimize(fn(text.data(), text.size(), out.data(), pending_cr));
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+// 256 KiB buffers (what STOR/RETR use), short log lines and long CSV rows
+#define ASCII_ARGS ->Args({256 * 1024, 40})->Args({256 * 1024, 200})
+
+BENCHMARK_CAPTURE(bench_encode, scalar, Ascii::encode_scalar) ASCII_ARGS;
+BENCHMARK_CAPTURE(bench_decode, scalar, Ascii::decode_scalar) ASCII_ARGS;
+#ifdef __SSE2__
+BENCHMARK_CAPTURE(bench_encode, sse2, Ascii::encode_sse2) ASCII_ARGS;
+BENCHMARK_CAPTURE(bench_decode, sse2, Ascii::decode_sse2) ASCII_ARGS;
+#endif
+#ifdef ASCII_HAVE_AVX2
+BENCHMARK_CAPTURE(bench_encode, avx2, Ascii::encode_avx2) ASCII_ARGS;
+BENCHMARK_CAPTURE(bench_decode, avx2, Ascii::decode_avx2) ASCII_ARGS;
+#endif
+
+BENCHMARK_MAIN();
@@ -0,0 +1,361 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+bench_control.cpp: microbenchmarks for the per-command control path, with a
+baseline to check for regressions against
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <benchmark/benchmark.h>
+#include "Session.hpp"
+
+// what a typical client sends between transfers (data commands need a data
+// connection, so they're left out; FEAT and NOOP get a 502 like any
+// unknown command)
+static std::vector<std::string> const commands = {
+  "USER anonymous", "SYST", "FEAT", "PWD", "TYPE I", "CWD pub", "PWD",
+  "PORT 127,0,0,1,200,10", "CWD releases/2014", "TYPE A", "MODE S", "STRU F",
+  "CWD ..", "CWD /incoming", "NOOP", "PORT 10,0,0,5,19,137", "CWD ../pub/releases",
+  "TYPE I", "PWD", "CWD /"
+};
+
+static std::vector<std::string> const port_args = {
+  "127,0,0,1,200,10", "10,0,0,5,19,137", "192,168,100,254,255,255",
+  "172,16,0,1,4,1", "127 ,0 ,0 ,1 ,200 ,10", "1,2,3"
+};
+
+static std::vector<int> const codes = {
+  150, 200, 215, 220, 226, 230, 250, 450, 451, 500, 501, 502, 530, 550, 999
+};
+
+// (cwd, argument) pairs as CWD/RETR/STOR see them
+static std::vector<std::pair<std::string, std::string> > const paths = {
+  { "/", "pub" }, { "/pub", "releases/2014" }, { "/pub/releases/2014", ".." },
+  { "/pub/releases", "../../incoming" }, { "/", "/pub/releases/2014/file.tar.gz" },
+  { "/incoming", "./upload.bin" }, { "/pub", "../../../../etc/passwd" },
+  { "/pub/releases/2014", "/" }
+};
+
+static std::vector<std::string> const cwd_args = {
+  "pub", "releases", "2014", "..", "/incoming", "../pub/releases/2014", "/",
+  "missing", "../../.."
+};
+
+// a sandbox tree, a session on one end of a socketpair, and a thread that
+// swallows the replies on the other end
+struct SessionBench {
+  SessionBench() : stats(1), watcher(), paths(_make_root()), listings(watcher) {
+    this->paths.attach(this->watcher);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, this->fds);
+
+    SessionContext ctx { &this->config, nullptr, this->stats.slot(0), nullptr, nullptr,
+			 nullptr, nullptr, &this->watcher, &this->paths, &this->listings };
+    sockaddr_in sender { };
+    this->sess = new Session(this->fds[0], sender, ctx);
+    this->sess->logged_in = true;
+    this->drain = std::thread([this] {
+	char buf[4096];
+
+	while (read(this->fds[1], buf, sizeof(buf)) > 0) {
+	}
+      });
+  }
+
+  ~SessionBench() {
+    // the session closes its end, which ends the drain thread
+    delete this->sess;
+    this->drain.join();
+    close(this->fds[1]);
+
+    std::string root = this->paths.root();
+    rmdir((root + "/pub/releases/2014").c_str());
+    rmdir((root + "/pub/releases").c_str());
+    rmdir((root + "/pub").c_str());
+    rmdir((root + "/incoming").c_str());
+    rmdir(root.c_str());
+  }
+
+  // queue up command lines for prompt_once() to read
+  void feed(std::string const& input) {
+    ssize_t res = write(this->fds[1], input.data(), input.size());
+    (void)res;
+  }
+
+  // the private methods under test
+  void prompt_once() {
+    this->sess->prompt_once();
+  }
+
+  bool port(std::string const& args) {
+    std::stringstream ss(args);
+    return this->sess->PORT("PORT", ss);
+  }
+
+  std::string msg_for_code(int code) const {
+    return this->sess->_msg_for_code(code);
+  }
+
+  bool set_cwd(std::string const& path) {
+    return this->sess->_set_cwd(path);
+  }
+
+  static std::string _make_root() {
+    char tmpl[] = "/tmp/bench_control.XXXXXX";
+    std::string root = mkdtemp(tmpl);
+    mkdir((root + "/pub").c_str(), 0755);
+    mkdir((root + "/pub/releases").c_str(), 0755);
+    mkdir((root + "/pub/releases/2014").c_str(), 0755);
+    mkdir((root + "/incoming").c_str(), 0755);
+
+    char real[PATH_MAX + 1] { };
+    return realpath(root.c_str(), real);
+  }
+
+  Config config;
+  Stats stats;
+  Watcher watcher;
+  PathResolver paths;
+  ListingCache listings;
+  int fds[2];
+  Session* sess;
+  std::thread drain;
+};
+
+// read one line off the socket, split it, count it, dispatch it
+static void bench_prompt_once(benchmark::State& state) {
+  SessionBench b;
+  std::string corpus;
+
+  for (auto const& c : commands) {
+    corpus += c + "\r\n";
+  }
+
+  size_t i = 0;
+
+  for (auto _ : state) {
+    if (i++ % commands.size() == 0) {
+      state.PauseTiming();
+      b.feed(corpus);
+      state.ResumeTiming();
+    }
+
+    b.prompt_once();
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void bench_port(benchmark::State& state) {
+  SessionBench b;
+  size_t i = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(b.port(port_args[i++ % port_args.size()]));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void bench_msg_for_code(benchmark::State& state) {
+  SessionBench b;
+
+  for (auto _ : state) {
+    for (int code : codes) {
+      benchmark::DoNotOptimize(b.msg_for_code(code));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * codes.size());
+}
+
+static void bench_fakify(benchmark::State& state) {
+  SessionBench b;
+  std::string const& root = b.paths.root();
+  std::vector<std::string> reals = {
+    root, root + "/pub", root + "/pub/releases/2014/file.tar.gz", root + "/incoming",
+    "/etc/passwd"
+  };
+
+  for (auto _ : state) {
+    for (auto const& real : reals) {
+      benchmark::DoNotOptimize(b.paths.fakify(real));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * reals.size());
+}
+
+static void bench_begins_with(benchmark::State& state) {
+  std::string const root = "/srv/ftp/anonymous";
+  std::vector<std::string> reals = {
+    root + "/pub/releases/2014/file.tar.gz", root, "/srv/ftp/anonymous2/x", "/etc/passwd"
+  };
+
+  for (auto _ : state) {
+    for (auto const& real : reals) {
+      benchmark::DoNotOptimize(PathResolver::begins_with(real, root));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * reals.size());
+}
+
+// what used to be Session::_get_abspath
+static void bench_normalize(benchmark::State& state) {
+  for (auto _ : state) {
+    for (auto const& p : paths) {
+      benchmark::DoNotOptimize(PathResolver::normalize(p.first, p.second));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * paths.size());
+}
+
+// with the dentry cache warm (0) or dropped before every call (1)
+static void bench_set_cwd(benchmark::State& state) {
+  SessionBench b;
+  bool cold = state.range(0);
+  size_t i = 0;
+
+  for (auto _ : state) {
+    if (cold) {
+      b.paths.clear();
+    }
+
+    benchmark::DoNotOptimize(b.set_cwd(cwd_args[i++ % cwd_args.size()]));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(bench_prompt_once);
+BENCHMARK(bench_port);
+BENCHMARK(bench_msg_for_code);
+BENCHMARK(bench_fakify);
+BENCHMARK(bench_begins_with);
+BENCHMARK(bench_normalize);
+BENCHMARK(bench_set_cwd)->Arg(0)->Arg(1);
+
+// the console output, plus the fastest time per iteration of every case
+// (the best of several repetitions is the least noisy number)
+class BaselineReporter : public benchmark::ConsoleReporter {
+public:
+  void ReportRuns(std::vector<Run> const& runs) override {
+    for (auto const& r : runs) {
+      if (r.run_type != Run::RT_Iteration || r.error_occurred) {
+	continue;
+      }
+
+      double ns = r.GetAdjustedRealTime() * 1e9 / benchmark::GetTimeUnitMultiplier(r.time_unit);
+      auto it = this->ns.find(r.benchmark_name());
+
+      if (it == this->ns.end() || ns < it->second) {
+	this->ns[r.benchmark_name()] = ns;
+      }
+    }
+
+    ConsoleReporter::ReportRuns(runs);
+  }
+
+  std::map<std::string, double> ns;
+};
+
+// "<name> <ns per iteration>" lines
+static std::map<std::string, double> load_baseline(std::string const& path) {
+  std::map<std::string, double> baseline;
+  std::ifstream in(path.c_str());
+  std::string name;
+  double ns;
+
+  while (in >> name >> ns) {
+    baseline[name] = ns;
+  }
+
+  return baseline;
+}
+
+// takes the usual benchmark flags, plus:
+//   --baseline=<file>       compare against <file>; exit 1 on a regression
+//   --save_baseline=<file>  write this run's numbers to <file>
+//   --threshold=<percent>   how much slower counts as a regression (25)
+int main(int argc, char* argv[]) {
+  std::string baseline_path, save_path;
+  double threshold = 25;
+  std::vector<char*> args;
+
+  for (int i = 0; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg.compare(0, 11, "--baseline=") == 0) {
+      baseline_path = arg.substr(11);
+    } else if (arg.compare(0, 16, "--save_baseline=") == 0) {
+      save_path = arg.substr(16);
+    } else if (arg.compare(0, 12, "--threshold=") == 0) {
+      threshold = atof(arg.substr(12).c_str());
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  int nargs = args.size();
+  benchmark::Initialize(&nargs, args.data());
+
+  if (benchmark::ReportUnrecognizedArguments(nargs, args.data())) {
+    return 1;
+  }
+
+  BaselineReporter reporter;
+  benchmark::RunSpecifiedBenchmarks(&reporter);
+  benchmark::Shutdown();
+
+  if (!save_path.empty()) {
+    std::ofstream out(save_path.c_str());
+
+    for (auto const& r : reporter.ns) {
+      char ns[32];
+      snprintf(ns, sizeof(ns), "%.1f", r.second);
+      out << r.first << ' ' << ns << '\n';
+    }
+
+    std::cout << std::endl << "baseline saved to " << save_path << std::endl;
+  }
+
+  if (baseline_path.empty()) {
+    return 0;
+  }
+
+  // one line per case: how it moved, and whether that's a regression
+  std::map<std::string, double> baseline = load_baseline(baseline_path);
+  int regressions = 0;
+  std::cout << std::endl << "vs " << baseline_path << " (threshold " << threshold << "%):"
+	    << std::endl;
+
+  for (auto const& r : reporter.ns) {
+    auto it = baseline.find(r.first);
+
+    if (it == baseline.end() || it->second <= 0) {
+      printf("  %-28s %10.1f ns  (no baseline)\n", r.first.c_str(), r.second);
+      continue;
+    }
+
+    double change = 100.0 * (r.second - it->second) / it->second;
+    bool slower = change > threshold;
+    regressions += slower;
+    printf("  %-28s %10.1f ns  %+6.1f%%  %s\n", r.first.c_str(), r.second, change,
+	   slower ? "REGRESSION" : "ok");
+  }
+
+  std::cout << (regressions ? "FAIL: " : "PASS: ") << regressions << " regression(s)"
+	    << std::endl;
+  return regressions ? 1 : 0;
+}
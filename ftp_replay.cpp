@@ -0,0 +1,645 @@
+/*
+Neal Patel (nap7jz)
+12/10/2014
+ftp_replay.cpp: replays a session trace (my_ftpd -t) against a server
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef std::chrono::steady_clock Clock;
+
+// one line of the trace
+struct Record {
+  uint64_t usec;
+  std::string session;
+  uint64_t elapsed;
+  uint64_t bytes;
+  std::string line;
+
+  std::string command() const {
+    return this->line.substr(0, this->line.find(' '));
+  }
+
+  std::string argument() const {
+    size_t space = this->line.find(' ');
+    return (space == std::string::npos ? std::string() : this->line.substr(space + 1));
+  }
+};
+
+// latencies and bytes of one kind of command
+struct Result {
+  std::vector<uint64_t> usec;
+  uint64_t errors;
+  uint64_t bytes;
+
+  Result() : errors(0), bytes(0) {
+  }
+
+  void merge(Result const& other) {
+    this->usec.insert(this->usec.end(), other.usec.begin(), other.usec.end());
+    this->errors += other.errors;
+    this->bytes += other.bytes;
+  }
+};
+
+typedef std::map<std::string, Result> Results;
+
+void usage(char const* program_name) {
+  std::cerr << "Usage: " << program_name << " [-s <speed>] [-d <root>] [-b <report>] [-h <host>] <port> <trace>" << std::endl;
+  std::cerr << "-s <speed>: replay this many times faster than recorded (default: 1)" << std::endl;
+  std::cerr << "-d <root>: first create the dirs and files the trace reads, in the server's root" << std::endl;
+  std::cerr << "-b <report>: print deltas against an earlier report (this program's output)" << std::endl;
+  std::cerr << "-h <host>: server address (default: 127.0.0.1)" << std::endl;
+  exit(1);
+}
+
+// read every record from `path`, in file order
+bool load_trace(std::string const& path, std::vector<Record>& records) {
+  std::ifstream in(path.c_str());
+
+  if (!in) {
+    return false;
+  }
+
+  std::string text;
+
+  while (std::getline(in, text)) {
+    std::stringstream ss(text);
+    Record r;
+    ss >> r.usec >> r.session >> r.elapsed >> r.bytes;
+
+    if (ss.fail()) {
+      continue;
+    }
+
+    ss.get();
+    std::getline(ss, r.line);
+    records.push_back(r);
+  }
+
+  // workers append independently, so lines are only roughly in time order
+  std::stable_sort(records.begin(), records.end(),
+		   [](Record const& a, Record const& b) { return a.usec < b.usec; });
+  return true;
+}
+
+// lexical "cwd + path" (the server resolves symlinks; we can't and needn't)
+std::string join(std::string const& cwd, std::string const& path) {
+  std::string full = (!path.empty() && path[0] == '/' ? path : cwd + '/' + path);
+  std::vector<std::string> parts;
+  std::stringstream ss(full);
+  std::string part;
+
+  while (std::getline(ss, part, '/')) {
+    if (part.empty() || part == ".") {
+      continue;
+    } else if (part == "..") {
+      if (!parts.empty()) {
+	parts.pop_back();
+      }
+    } else {
+      parts.push_back(part);
+    }
+  }
+
+  std::string out;
+
+  for (auto const& p : parts) {
+    out += '/' + p;
+  }
+
+  return (out.empty() ? "/" : out);
+}
+
+void make_dirs(std::string const& root, std::string const& vpath) {
+  std::string path = root;
+  std::stringstream ss(vpath);
+  std::string part;
+
+  while (std::getline(ss, part, '/')) {
+    if (!part.empty()) {
+      path += '/' + part;
+      mkdir(path.c_str(), 0755);
+    }
+  }
+}
+
+// text-like filler, so TYPE A and compression see something realistic
+void make_file(std::string const& root, std::string const& vpath, uint64_t size) {
+  make_dirs(root, vpath.substr(0, vpath.rfind('/')));
+
+  int fd = open((root + vpath).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd == -1) {
+    return;
+  }
+
+  std::string block;
+
+  while (block.size() < 1024 * 1024) {
+    block += "2014-12-10 00:00:00,replayed,0123456789,abcdefghijklmnopqrstuvwxyz\n";
+  }
+
+  for (uint64_t done = 0; done < size; ) {
+    size_t len = std::min<uint64_t>(block.size(), size - done);
+    ssize_t cnt = write(fd, block.data(), len);
+
+    if (cnt <= 0) {
+      break;
+    }
+
+    done += cnt;
+  }
+
+  close(fd);
+}
+
+// create what the trace expects to find: dirs it enters and files it
+// downloads, unless the trace itself makes them first
+void populate(std::string const& root, std::vector<Record> const& records) {
+  std::map<std::string, std::string> cwds;
+  std::set<std::string> made;
+
+  for (auto const& r : records) {
+    std::string cmd = r.command();
+    std::string& cwd = cwds[r.session];
+
+    if (cwd.empty()) {
+      cwd = "/";
+    }
+
+    if (cmd == "CWD" || cmd == "RMD") {
+      std::string dir = join(cwd, r.argument());
+
+      if (!made.count(dir)) {
+	make_dirs(root, dir);
+	made.insert(dir);
+      }
+
+      if (cmd == "CWD") {
+	cwd = dir;
+      }
+    } else if (cmd == "MKD" || cmd == "STOR") {
+      made.insert(join(cwd, r.argument()));
+    } else if (cmd == "RETR") {
+      std::string file = join(cwd, r.argument());
+
+      if (!made.count(file)) {
+	make_file(root, file, r.bytes);
+	made.insert(file);
+      }
+    }
+  }
+}
+
+bool send_all(int fd, char const* buf, size_t len) {
+  while (len > 0) {
+    ssize_t cnt = send(fd, buf, len, MSG_NOSIGNAL);
+
+    if (cnt == -1 && errno == EINTR) {
+      continue;
+    } else if (cnt <= 0) {
+      return false;
+    }
+
+    buf += cnt;
+    len -= cnt;
+  }
+
+  return true;
+}
+
+// read one reply line; returns its code (0 if it has none, -1 on EOF)
+int read_reply(int fd) {
+  std::string line;
+  char c;
+
+  for (;;) {
+    ssize_t cnt = recv(fd, &c, 1, 0);
+
+    if (cnt == -1 && errno == EINTR) {
+      continue;
+    } else if (cnt <= 0) {
+      return -1;
+    } else if (c == '\n') {
+      break;
+    }
+
+    line.push_back(c);
+  }
+
+  if (line.size() >= 3 && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2])) {
+    return atoi(line.substr(0, 3).c_str());
+  }
+
+  return 0;
+}
+
+// replays one session's records on its own connection
+class Player {
+public:
+  Player(sockaddr_in const& server_, Clock::time_point start_, uint64_t origin_,
+	 double speed_) :
+    server(server_), start(start_), origin(origin_), speed(speed_), ctrl(-1),
+    listener(-1) {
+  }
+
+  void play(std::vector<Record const*> const& records) {
+    for (auto const* r : records) {
+      std::string cmd = r->command();
+
+      // neither TLS nor compression is replayed: the same commands run in
+      // the clear, in Stream mode
+      if (cmd == "AUTH" || cmd == "PBSZ" || cmd == "PROT" || cmd == "OPTS" ||
+	  (cmd == "MODE" && r->argument() != "S")) {
+	continue;
+      }
+
+      this->_wait_until(r->usec);
+
+      if (cmd == "+") {
+	if (!this->_connect()) {
+	  break;
+	}
+      } else if (cmd == "-") {
+	break;
+      } else if ((this->ctrl == -1 && !this->_connect()) || !this->_run(*r)) {
+	// (a trace may start in the middle of a session)
+	break;
+      }
+    }
+
+    if (this->ctrl != -1) {
+      close(this->ctrl);
+    }
+
+    if (this->listener != -1) {
+      close(this->listener);
+    }
+  }
+
+  Results results;
+
+private:
+  // sleep until the (scaled) moment the record happened; if we're behind,
+  // go right away
+  void _wait_until(uint64_t usec) {
+    auto offset = std::chrono::microseconds((uint64_t)((usec - this->origin) / this->speed));
+    std::this_thread::sleep_until(this->start + offset);
+  }
+
+  static uint64_t _since(Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t).count();
+  }
+
+  bool _connect() {
+    Clock::time_point t = Clock::now();
+    Result& res = this->results["CONNECT"];
+    this->ctrl = socket(AF_INET, SOCK_STREAM, 0);
+
+    timeval tv { 60, 0 };
+    setsockopt(this->ctrl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (connect(this->ctrl, (sockaddr*)&this->server, sizeof(this->server)) != 0 ||
+	read_reply(this->ctrl) != 220) {
+      res.errors++;
+      close(this->ctrl);
+      this->ctrl = -1;
+      return false;
+    }
+
+    res.usec.push_back(_since(t));
+    return true;
+  }
+
+  // our own PORT: a listener on the address the server sees us at
+  std::string _port_command() {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(this->ctrl, (sockaddr*)&addr, &len);
+
+    if (this->listener == -1) {
+      this->listener = socket(AF_INET, SOCK_STREAM, 0);
+      addr.sin_port = 0;
+
+      if (bind(this->listener, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+	  listen(this->listener, 4) != 0) {
+	return "PORT";
+      }
+    }
+
+    getsockname(this->listener, (sockaddr*)&addr, &len);
+    uint32_t ip = ntohl(addr.sin_addr.s_addr);
+    uint16_t port = ntohs(addr.sin_port);
+
+    std::stringstream cmd;
+    cmd << "PORT " << (ip >> 24) << ',' << ((ip >> 16) & 255) << ',' << ((ip >> 8) & 255)
+	<< ',' << (ip & 255) << ',' << (port >> 8) << ',' << (port & 255);
+    return cmd.str();
+  }
+
+  // take the server's data connection and move `bytes` (STOR) or
+  // everything it sends (LIST, RETR); returns the bytes moved
+  uint64_t _transfer(bool upload, uint64_t bytes) {
+    pollfd pfd { this->listener, POLLIN, 0 };
+
+    if (this->listener == -1 || poll(&pfd, 1, 60 * 1000) != 1) {
+      return 0;
+    }
+
+    int dfd = accept(this->listener, NULL, NULL);
+
+    if (dfd == -1) {
+      return 0;
+    }
+
+    std::vector<char> buf(256 * 1024, 'x');
+    uint64_t done = 0;
+
+    if (upload) {
+      while (done < bytes) {
+	size_t len = std::min<uint64_t>(buf.size(), bytes - done);
+
+	if (!send_all(dfd, buf.data(), len)) {
+	  break;
+	}
+
+	done += len;
+      }
+    } else {
+      ssize_t cnt;
+
+      while ((cnt = recv(dfd, buf.data(), buf.size(), 0)) > 0) {
+	done += cnt;
+      }
+    }
+
+    close(dfd);
+    return done;
+  }
+
+  // send one command and wait for its final reply
+  bool _run(Record const& r) {
+    std::string cmd = r.command();
+    std::string line = (cmd == "PORT" ? this->_port_command() : r.line);
+    Result& res = this->results[cmd];
+
+    Clock::time_point t = Clock::now();
+    line += "\r\n";
+
+    if (!send_all(this->ctrl, line.data(), line.size())) {
+      res.errors++;
+      return false;
+    }
+
+    int code = read_reply(this->ctrl);
+
+    if (code == 150 && (cmd == "LIST" || cmd == "RETR" || cmd == "STOR")) {
+      res.bytes += this->_transfer(cmd == "STOR", r.bytes);
+      code = read_reply(this->ctrl);
+    }
+
+    if (code == -1) {
+      // QUIT closing the connection is the only expected way out
+      if (cmd != "QUIT") {
+	res.errors++;
+      }
+
+      return false;
+    }
+
+    res.usec.push_back(_since(t));
+
+    if (code >= 400) {
+      res.errors++;
+    }
+
+    return true;
+  }
+
+  sockaddr_in server;
+  Clock::time_point start;
+  uint64_t origin;
+  double speed;
+  int ctrl;
+  int listener;
+};
+
+// "NAME key=value key=value ..." lines of an earlier report
+std::map<std::string, std::map<std::string, double> > load_report(std::string const& path) {
+  std::map<std::string, std::map<std::string, double> > report;
+  std::ifstream in(path.c_str());
+  std::string text;
+
+  while (std::getline(in, text)) {
+    std::stringstream ss(text);
+    std::string name, field;
+    ss >> name;
+
+    if (name.empty() || name[0] == '#') {
+      continue;
+    }
+
+    while (ss >> field) {
+      size_t eq = field.find('=');
+
+      if (eq != std::string::npos) {
+	report[name][field.substr(0, eq)] = atof(field.substr(eq + 1).c_str());
+      }
+    }
+  }
+
+  return report;
+}
+
+std::string delta(double now, double before) {
+  if (before <= 0) {
+    return "n/a";
+  }
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%+.1f%%", 100.0 * (now - before) / before);
+  return buf;
+}
+
+// print one report line, with deltas if the baseline has the same line
+void report_line(std::string const& name, Result& res, uint64_t wall_usec,
+		 std::map<std::string, std::map<std::string, double> > const& baseline) {
+  std::vector<uint64_t>& v = res.usec;
+  std::sort(v.begin(), v.end());
+
+  double mean = 0;
+
+  for (uint64_t u : v) {
+    mean += u;
+  }
+
+  mean = (v.empty() ? 0 : mean / v.size());
+  uint64_t p50 = (v.empty() ? 0 : v[v.size() / 2]);
+  uint64_t p99 = (v.empty() ? 0 : v[std::min(v.size() - 1, v.size() * 99 / 100)]);
+
+  std::cout << name << " count=" << v.size() << " errors=" << res.errors
+	    << " mean_usec=" << (uint64_t)mean << " p50_usec=" << p50
+	    << " p99_usec=" << p99 << " bytes=" << res.bytes;
+
+  double rate = 0;
+
+  if (wall_usec > 0) {
+    rate = res.bytes * 1e6 / wall_usec;
+    std::cout << " wall_usec=" << wall_usec << " bytes_per_sec=" << (uint64_t)rate;
+  }
+
+  auto base = baseline.find(name);
+
+  if (base != baseline.end()) {
+    auto get = [&](char const* key) {
+      auto it = base->second.find(key);
+      return (it == base->second.end() ? 0.0 : it->second);
+    };
+
+    std::cout << " d_mean=" << delta(mean, get("mean_usec"))
+	      << " d_p50=" << delta(p50, get("p50_usec"))
+	      << " d_p99=" << delta(p99, get("p99_usec"));
+
+    if (wall_usec > 0) {
+      std::cout << " d_bytes_per_sec=" << delta(rate, get("bytes_per_sec"));
+    }
+  }
+
+  std::cout << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  char const* program_name = (argc >= 1 ? argv[0] : "ftp_replay");
+  double speed = 1;
+  std::string root, baseline_path, host = "127.0.0.1";
+
+  // parse command-line options
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:d:b:h:")) != -1) {
+    switch (opt) {
+    case 's':
+      speed = atof(optarg);
+
+      if (speed <= 0) {
+	usage(program_name);
+      }
+
+      break;
+    case 'd':
+      root = optarg;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 'h':
+      host = optarg;
+      break;
+    default:
+      usage(program_name);
+    }
+  }
+
+  // parse command-line args
+  if (argc - optind != 2) {
+    usage(program_name);
+  }
+
+  int port = atoi(argv[optind]);
+  std::string trace_path = argv[optind + 1];
+  sockaddr_in server { };
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+
+  if (port < 1 || port > 65535 || inet_pton(AF_INET, host.c_str(), &server.sin_addr) != 1) {
+    usage(program_name);
+  }
+
+  std::vector<Record> records;
+
+  if (!load_trace(trace_path, records) || records.empty()) {
+    std::cerr << "no records in " << trace_path << std::endl;
+    return 1;
+  }
+
+  if (!root.empty()) {
+    populate(root, records);
+  }
+
+  // one player per recorded session, all on the trace's clock
+  std::map<std::string, std::vector<Record const*> > sessions;
+
+  for (auto const& r : records) {
+    sessions[r.session].push_back(&r);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  Clock::time_point start = Clock::now();
+  std::vector<Player*> players;
+  std::vector<std::thread> threads;
+
+  for (auto const& s : sessions) {
+    Player* p = new Player(server, start, records.front().usec, speed);
+    players.push_back(p);
+    threads.push_back(std::thread(&Player::play, p, std::cref(s.second)));
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  uint64_t wall = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+
+  // sum up and report
+  Results results;
+  Result total;
+
+  for (auto* p : players) {
+    for (auto const& r : p->results) {
+      results[r.first].merge(r.second);
+      total.merge(r.second);
+    }
+
+    delete p;
+  }
+
+  std::map<std::string, std::map<std::string, double> > baseline;
+
+  if (!baseline_path.empty()) {
+    baseline = load_report(baseline_path);
+  }
+
+  std::cout << "# " << trace_path << ": " << sessions.size() << " sessions, "
+	    << records.size() << " records, speed " << speed << std::endl;
+
+  for (auto& r : results) {
+    report_line(r.first, r.second, 0, baseline);
+  }
+
+  report_line("TOTAL", total, wall, baseline);
+  return 0;
+}
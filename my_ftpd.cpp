@@ -5,38 +5,106 @@ my_ftpd.cpp: FTP server program
 */
 #include <iostream>
 #include <cstdlib>
+#include <unistd.h>
+#include <csignal>
 #include "Server.hpp"
 
 void usage(char const* program_name) {
-  std::cerr << "Usage: " << program_name << " <port>" << std::endl;
+  std::cerr << "Usage: " << program_name << " [-w <workers>] [-r <bytes>] [-c <cert> -k <key>] [-t <file>] [-D <dir>] [-z <dir>] [-j <threads>] <port>" << std::endl;
   std::cerr << "<port>: a valid and *available* port number" << std::endl;
+  std::cerr << "-w <workers>: prefork this many worker processes (default: 0, no forking)" << std::endl;
+  std::cerr << "-r <bytes>: read-ahead window for uncached RETR (default: 4194304)" << std::endl;
+  std::cerr << "-c <cert> -k <key>: PEM certificate and key, enables AUTH TLS" << std::endl;
+  std::cerr << "-t <file>: append a trace of every session's commands (see ftp_replay)" << std::endl;
+  std::cerr << "-D <dir>: store uploads as deduplicated chunks in this dir (outside the served tree)" << std::endl;
+  std::cerr << "-z <dir>: keep MODE Z compressed copies of downloads here (outside the served tree)" << std::endl;
+  std::cerr << "-j <threads>: MODE Z compression threads per process (default: one per CPU, up to 4)" << std::endl;
   exit(1);
 }
 
 int main(int argc, char* argv[]) {
   char const* program_name = (argc >= 1 ? argv[0] : "my_ftpd");
+  Config config;
 
-  // parse command-line arg
-  if (argc != 2) {
+  // parse command-line options
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:r:c:k:t:D:z:j:")) != -1) {
+    switch (opt) {
+    case 'w': {
+      int workers = atoi(optarg);
+
+      if (workers < 1 || workers > 1024) {
+	usage(program_name);
+      }
+
+      config.workers = workers;
+      break;
+    }
+    case 'r': {
+      long long window = atoll(optarg);
+
+      if (window < 1) {
+	usage(program_name);
+      }
+
+      config.readahead_window = window;
+      break;
+    }
+    case 'c':
+      config.tls_cert = optarg;
+      break;
+    case 'k':
+      config.tls_key = optarg;
+      break;
+    case 't':
+      config.trace_path = optarg;
+      break;
+    case 'D':
+      config.dedup_store = optarg;
+      break;
+    case 'z':
+      config.zcache_dir = optarg;
+      break;
+    case 'j': {
+      int threads = atoi(optarg);
+
+      if (threads < 1 || threads > 256) {
+	usage(program_name);
+      }
+
+      config.compress_threads = threads;
+      break;
+    }
+    default:
+      usage(program_name);
+    }
+  }
+
+  // parse command-line arg (a certificate needs its key and vice versa)
+  if (argc - optind != 1 || config.tls_cert.empty() != config.tls_key.empty()) {
     usage(program_name);
   }
 
-  int port = atoi(argv[1]);
+  int port = atoi(argv[optind]);
 
   // validate command-line arg
   if (port < 1 || port > 65535) {
     usage(program_name);
   }
 
+  // a client hanging up mid-transfer shouldn't kill us
+  signal(SIGPIPE, SIG_IGN);
+
   // create a server object
-  Server serv((uint16_t)port);
+  Server serv((uint16_t)port, config);
 
   // try to listen on the given port
   if (!serv.initialize()) {
     usage(program_name);
   }
 
-  // accept incoming connections on a new thread, forever
+  // accept incoming connections (in worker processes if asked to), forever
   serv.start();
 
   // unreachable